@@ -1,141 +1,4729 @@
 #include <iostream>
 #include <vector>
+#include <array>
 #include <memory>
 #include <stack>
 #include <sstream>
 #include <algorithm>
 #include <string>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <cmath>
+#include <cctype>
+#include <cstring>
+#include <limits>
+#include <fstream>
+#include <random>
+#include <chrono>
+#include <mutex>
+#include <variant>
+#include <stdexcept>
+#include <exception>
+#include <cstdio>
+#include <cerrno>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <poll.h>
+#define LB5_HAVE_FORK
+#define LB5_HAVE_POLL
+#endif
 
 using namespace std;
 
+// Обмежувальний прямокутник (межі включні, як і в containsPoint)
+struct BBox {
+    int minX = 0, minY = 0, maxX = -1, maxY = -1;
+    BBox() = default;
+    BBox(int x0, int y0, int x1, int y1) : minX(x0), minY(y0), maxX(x1), maxY(y1) {}
+    bool empty() const { return maxX < minX || maxY < minY; }
+    int width() const { return empty() ? 0 : maxX - minX + 1; }
+    int height() const { return empty() ? 0 : maxY - minY + 1; }
+    long long area() const { return (long long)width() * height(); }
+    bool contains(int px, int py) const {
+        return px >= minX && px <= maxX && py >= minY && py <= maxY;
+    }
+    bool contains(const BBox& o) const {
+        return o.empty() || (!empty() && o.minX >= minX && o.maxX <= maxX && o.minY >= minY && o.maxY <= maxY);
+    }
+    bool intersects(const BBox& o) const {
+        return !empty() && !o.empty() && o.minX <= maxX && o.maxX >= minX && o.minY <= maxY && o.maxY >= minY;
+    }
+    BBox intersect(const BBox& o) const {
+        return BBox(max(minX, o.minX), max(minY, o.minY), min(maxX, o.maxX), min(maxY, o.maxY));
+    }
+    BBox translated(int dx, int dy) const {
+        return empty() ? *this : BBox(minX + dx, minY + dy, maxX + dx, maxY + dy);
+    }
+    BBox inflated(int d) const {
+        return empty() ? *this : BBox(minX - d, minY - d, maxX + d, maxY + d);
+    }
+    void expand(const BBox& o) {
+        if (o.empty()) return;
+        if (empty()) { *this = o; return; }
+        minX = min(minX, o.minX); minY = min(minY, o.minY);
+        maxX = max(maxX, o.maxX); maxY = max(maxY, o.maxY);
+    }
+};
+
+// Лічильник посилань зберігається в самому об'єкті (див. Ref). Для
+// однопотокового редактора можна зібрати з -DLB5_SINGLE_THREADED: лічильник
+// стане звичайним int без атомарних операцій. У цьому режимі робочі потоки
+// лише читають сцену через посилання на вже наявні Ref і не копіюють їх.
+#ifdef LB5_SINGLE_THREADED
+class RefCount {
+    int n = 0;
+public:
+    void increment() { ++n; }
+    bool decrement() { return --n == 0; }
+    int value() const { return n; }
+};
+#else
+class RefCount {
+    atomic<int> n{0};
+public:
+    void increment() { n.fetch_add(1, memory_order_relaxed); }
+    bool decrement() { return n.fetch_sub(1, memory_order_acq_rel) == 1; }
+    int value() const { return n.load(memory_order_relaxed); }
+};
+#endif
+
+// Інтрузивний розумний вказівник: той самий інтерфейс, що й у shared_ptr,
+// але без окремого блоку керування. T має надавати addRef()/release().
+template <class T>
+class Ref {
+    T* p = nullptr;
+    template <class U> friend class Ref;
+public:
+    Ref() = default;
+    Ref(nullptr_t) {}
+    explicit Ref(T* ptr) : p(ptr) { if (p) p->addRef(); }
+    Ref(const Ref& o) : p(o.p) { if (p) p->addRef(); }
+    Ref(Ref&& o) noexcept : p(o.p) { o.p = nullptr; }
+    template <class U, class = enable_if_t<is_convertible<U*, T*>::value>>
+    Ref(const Ref<U>& o) : p(o.p) { if (p) p->addRef(); }
+    template <class U, class = enable_if_t<is_convertible<U*, T*>::value>>
+    Ref(Ref<U>&& o) noexcept : p(o.p) { o.p = nullptr; }
+    ~Ref() { reset(); }
+
+    Ref& operator=(Ref o) noexcept { swap(p, o.p); return *this; }
+    void reset() {
+        if (p && p->release()) delete p;
+        p = nullptr;
+    }
+
+    T* get() const { return p; }
+    T* operator->() const { return p; }
+    T& operator*() const { return *p; }
+    explicit operator bool() const { return p != nullptr; }
+    int use_count() const { return p ? p->useCount() : 0; }
+
+    template <class U> bool operator==(const Ref<U>& o) const { return p == o.p; }
+    template <class U> bool operator!=(const Ref<U>& o) const { return p != o.p; }
+    bool operator==(nullptr_t) const { return p == nullptr; }
+    bool operator!=(nullptr_t) const { return p != nullptr; }
+};
+
+template <class T, class... Args>
+Ref<T> makeRef(Args&&... args) {
+    return Ref<T>(new T(forward<Args>(args)...));
+}
+
+template <class T, class U>
+Ref<T> refCast(const Ref<U>& r) {
+    return Ref<T>(dynamic_cast<T*>(r.get()));
+}
+
+template <class T, class U>
+Ref<T> staticRefCast(const Ref<U>& r) {
+    return Ref<T>(static_cast<T*>(r.get()));
+}
+
+// Вектор із вбудованим буфером на N елементів: поки елементів не більше N,
+// купа не використовується. Більшість груп мають менше 8 дітей.
+template <class T, size_t N>
+class SmallVector {
+    alignas(T) unsigned char inlineBuf[N * sizeof(T)];
+    T* data_;
+    uint32_t size_ = 0, capacity_ = N;
+
+    T* inlineData() { return reinterpret_cast<T*>(inlineBuf); }
+    bool isInline() const { return data_ == reinterpret_cast<const T*>(inlineBuf); }
+    void grow(size_t minCapacity) {
+        size_t cap = max<size_t>(minCapacity, capacity_ * 2);
+        T* fresh = static_cast<T*>(::operator new(cap * sizeof(T)));
+        for (uint32_t i = 0; i < size_; ++i) {
+            new (fresh + i) T(move(data_[i]));
+            data_[i].~T();
+        }
+        if (!isInline()) ::operator delete(data_);
+        data_ = fresh;
+        capacity_ = (uint32_t)cap;
+    }
+public:
+    using iterator = T*;
+    using const_iterator = const T*;
+    using reverse_iterator = std::reverse_iterator<T*>;
+    using const_reverse_iterator = std::reverse_iterator<const T*>;
+
+    SmallVector() : data_(inlineData()) {}
+    SmallVector(const SmallVector& o) : SmallVector() {
+        reserve(o.size_);
+        for (auto& v : o) push_back(v);
+    }
+    SmallVector(SmallVector&& o) noexcept : SmallVector() {
+        if (!o.isInline()) {
+            data_ = o.data_; size_ = o.size_; capacity_ = o.capacity_;
+            o.data_ = o.inlineData(); o.size_ = 0; o.capacity_ = N;
+        } else {
+            for (auto& v : o) push_back(move(v));
+            o.clear();
+        }
+    }
+    SmallVector& operator=(SmallVector o) {
+        clear();
+        if (!o.isInline()) {
+            if (!isInline()) ::operator delete(data_);
+            data_ = o.data_; size_ = o.size_; capacity_ = o.capacity_;
+            o.data_ = o.inlineData(); o.size_ = 0; o.capacity_ = N;
+        } else {
+            for (auto& v : o) push_back(move(v));
+        }
+        return *this;
+    }
+    ~SmallVector() {
+        clear();
+        if (!isInline()) ::operator delete(data_);
+    }
+
+    void reserve(size_t n) { if (n > capacity_) grow(n); }
+    void push_back(T v) {
+        if (size_ == capacity_) grow(size_ + 1);
+        new (data_ + size_++) T(move(v));
+    }
+    void pop_back() { data_[--size_].~T(); }
+    void insert(size_t pos, T v) {
+        push_back(move(v));
+        rotate(data_ + pos, data_ + size_ - 1, data_ + size_);
+    }
+    void erase(size_t pos) {
+        rotate(data_ + pos, data_ + pos + 1, data_ + size_);
+        pop_back();
+    }
+    void clear() { while (size_) pop_back(); }
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    bool empty() const { return size_ == 0; }
+    bool onHeap() const { return !isInline(); }
+    T& operator[](size_t i) { return data_[i]; }
+    const T& operator[](size_t i) const { return data_[i]; }
+    T& back() { return data_[size_ - 1]; }
+    const T& back() const { return data_[size_ - 1]; }
+
+    iterator begin() { return data_; }
+    iterator end() { return data_ + size_; }
+    const_iterator begin() const { return data_; }
+    const_iterator end() const { return data_ + size_; }
+    reverse_iterator rbegin() { return reverse_iterator(end()); }
+    reverse_iterator rend() { return reverse_iterator(begin()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+};
+
+// Додає значення до 64-бітного хешу (перемішування як у splitmix64); порядок важливий
+inline uint64_t mixHash(uint64_t h, uint64_t v) {
+    uint64_t z = h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Тег типу фігури: дозволяє перевіряти тип без dynamic_cast
+enum class ShapeKind : uint16_t { Circle, Rectangle, Group };
+
+// Зведені показники піддерева: кількість вузлів кожного типу й сумарна площа.
+// Цілі суми додаються й віднімаються точно, тож групи оновлюють їх по шляху до кореня.
+struct SubtreeStats {
+    array<int64_t, 3> byKind{}; // кількість вузлів за ShapeKind
+    int64_t rectArea = 0;       // сума width * height прямокутників
+    int64_t circleR2 = 0;       // сума radius² кіл
+
+    int64_t count() const { return byKind[0] + byKind[1] + byKind[2]; }
+    int64_t of(ShapeKind kind) const { return byKind[(size_t)kind]; }
+    double area() const { return rectArea + 3.14159265358979 * circleR2; }
+    SubtreeStats& operator+=(const SubtreeStats& o) {
+        for (size_t k = 0; k < byKind.size(); ++k) byKind[k] += o.byKind[k];
+        rectArea += o.rectArea;
+        circleR2 += o.circleR2;
+        return *this;
+    }
+    SubtreeStats& operator-=(const SubtreeStats& o) {
+        for (size_t k = 0; k < byKind.size(); ++k) byKind[k] -= o.byKind[k];
+        rectArea -= o.rectArea;
+        circleR2 -= o.circleR2;
+        return *this;
+    }
+};
+
+// Діапазон ID вузлів піддерева. Після вилучення вузла не звужується, тож
+// лише відсікає піддерева, де ID напевно немає
+struct IdRange {
+    int lo = numeric_limits<int>::max(), hi = numeric_limits<int>::min();
+    bool empty() const { return hi < lo; }
+    bool contains(int id) const { return id >= lo && id <= hi; }
+    void expand(int id) { lo = min(lo, id); hi = max(hi, id); }
+    void expand(const IdRange& o) {
+        if (o.empty()) return;
+        lo = min(lo, o.lo);
+        hi = max(hi, o.hi);
+    }
+};
+
+class Group;
+
 // Базовий клас графічного об'єкта
 class GraphicObject {
+    // Атомарні: об'єкти створюються й декодуються з кількох потоків
+    static atomic<int>& idCounter() { static atomic<int> counter{0}; return counter; }
+    static int nextId() { return ++idCounter(); }
+    // Спільний годинник версій: кожен новий чи змінений вузол отримує більше значення
+    static atomic<uint64_t>& versionClock() { static atomic<uint64_t> clock{0}; return clock; }
+    mutable RefCount refs;
+    friend class SceneCodec;
+    friend class Group;
 protected:
+    uint64_t version;        // змінюється разом із вузлом і з будь-ким із його нащадків
+    Group* parent = nullptr; // група, що містить вузол (не володіє ним)
+    int id;
     int x, y;
+    ShapeKind kind; // 16 біт у хвостовому вирівнюванні, поруч із полями нащадків
+
+    // Нова версія вузла; предки отримують ту саму, тож кеш, побудований над
+    // піддеревом, перевіряє свою актуальність одним порівнянням
+    void markChanged();
 public:
-    GraphicObject(int x = 0, int y = 0) : x(x), y(y) {}
+    GraphicObject(ShapeKind kind, int x = 0, int y = 0)
+        : version(++versionClock()), id(nextId()), x(x), y(y), kind(kind) {}
+    // Копія — це новий об'єкт, тому отримує власний ID, версію й нульовий лічильник
+    GraphicObject(const GraphicObject& other)
+        : version(++versionClock()), id(nextId()), x(other.x), y(other.y), kind(other.kind) {}
+    GraphicObject& operator=(const GraphicObject&) = delete;
     virtual void draw(ostream& os, int indent = 0) const = 0;
     virtual bool containsPoint(int px, int py) const = 0;
-    virtual shared_ptr<GraphicObject> clone() const = 0;
-    virtual void move(int dx, int dy) { x += dx; y += dy; }
+    // Межі в системі координат батьківської групи
+    virtual BBox bounds() const = 0;
+    virtual Ref<GraphicObject> clone() const = 0;
+    // Структурний хеш: тип, позиція, розміри й (для групи) діти по порядку; ID не враховується
+    virtual uint64_t hash() const = 0;
+    // Показники піддерева разом із самим об'єктом; для групи — без обходу дітей
+    virtual SubtreeStats stats() const = 0;
+    virtual void move(int dx, int dy) { x += dx; y += dy; markChanged(); }
     virtual ~GraphicObject() = default;
     int getX() const { return x; }
     int getY() const { return y; }
+    int getId() const { return id; }
+    uint64_t getVersion() const { return version; }
+    Group* getParent() const { return parent; }
+    ShapeKind getKind() const { return kind; }
+
+    void addRef() const { refs.increment(); }
+    bool release() const { return refs.decrement(); }
+    int useCount() const { return refs.value(); }
+};
+
+// Перевірка типу за тегом: T::shapeKind має збігатися з getKind()
+template <class T>
+T* shapeCast(GraphicObject* obj) {
+    return obj && obj->getKind() == T::shapeKind ? static_cast<T*>(obj) : nullptr;
+}
+template <class T>
+const T* shapeCast(const GraphicObject* obj) {
+    return obj && obj->getKind() == T::shapeKind ? static_cast<const T*>(obj) : nullptr;
+}
+
+// Коло
+class Circle : public GraphicObject {
+    int radius;
+public:
+    static constexpr ShapeKind shapeKind = ShapeKind::Circle;
+    Circle(int x, int y, int r) : GraphicObject(shapeKind, x, y), radius(r) {}
+    void draw(ostream& os, int indent = 0) const override {
+        os << string(indent, '+') << "Circle (" << x << ", " << y << ") R=" << radius << "\n";
+    }
+    bool containsPoint(int px, int py) const override {
+        // У 64 бітах: для віддалених точок квадрати не вміщаються в int
+        int64_t dx = (int64_t)px - x, dy = (int64_t)py - y;
+        return dx*dx + dy*dy <= (int64_t)radius*radius;
+    }
+    BBox bounds() const override {
+        return BBox(x - radius, y - radius, x + radius, y + radius);
+    }
+    int getRadius() const { return radius; }
+    Ref<GraphicObject> clone() const override {
+        return makeRef<Circle>(*this);
+    }
+    uint64_t hash() const override {
+        return mixHash(mixHash(mixHash((uint64_t)kind, (uint32_t)x), (uint32_t)y), (uint32_t)radius);
+    }
+    SubtreeStats stats() const override {
+        SubtreeStats s;
+        s.byKind[(size_t)shapeKind] = 1;
+        s.circleR2 = (int64_t)radius * radius;
+        return s;
+    }
+};
+
+// Прямокутник
+class Rectangle : public GraphicObject {
+    int width, height;
+public:
+    static constexpr ShapeKind shapeKind = ShapeKind::Rectangle;
+    Rectangle(int x, int y, int w, int h) : GraphicObject(shapeKind, x, y), width(w), height(h) {}
+    void draw(ostream& os, int indent = 0) const override {
+        os << string(indent, '+') << "Rectangle (" << x << ", " << y << ") " << width << "*" << height << "\n";
+    }
+    bool containsPoint(int px, int py) const override {
+        return (px >= x && px <= x + width && py >= y && py <= y + height);
+    }
+    BBox bounds() const override {
+        return BBox(x, y, x + width, y + height);
+    }
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    Ref<GraphicObject> clone() const override {
+        return makeRef<Rectangle>(*this);
+    }
+    uint64_t hash() const override {
+        uint64_t h = mixHash(mixHash((uint64_t)kind, (uint32_t)x), (uint32_t)y);
+        return mixHash(mixHash(h, (uint32_t)width), (uint32_t)height);
+    }
+    SubtreeStats stats() const override {
+        SubtreeStats s;
+        s.byKind[(size_t)shapeKind] = 1;
+        s.rectArea = (int64_t)width * height;
+        return s;
+    }
+};
+
+// Двійковий запис: беззнакові числа — varint (7 біт на байт), знакові — zigzag + varint
+class ByteWriter {
+    vector<uint8_t> bytes;
+public:
+    void varint(uint64_t v) {
+        while (v >= 0x80) { bytes.push_back((uint8_t)(v | 0x80)); v >>= 7; }
+        bytes.push_back((uint8_t)v);
+    }
+    void svarint(int64_t v) { varint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63)); }
+    void raw(const uint8_t* data, size_t n) { bytes.insert(bytes.end(), data, data + n); }
+    size_t size() const { return bytes.size(); }
+    vector<uint8_t>& data() { return bytes; }
+    const vector<uint8_t>& data() const { return bytes; }
+};
+
+class ByteReader {
+    const uint8_t* begin;
+    const uint8_t* p;
+    const uint8_t* end;
+public:
+    ByteReader(const uint8_t* data, size_t n) : begin(data), p(data), end(data + n) {}
+    explicit ByteReader(const vector<uint8_t>& v) : ByteReader(v.data(), v.size()) {}
+    bool atEnd() const { return p == end; }
+    size_t remaining() const { return (size_t)(end - p); }
+    const uint8_t* position() const { return p; }
+    size_t consumed() const { return (size_t)(p - begin); }
+    uint64_t varint() {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (p == end) throw runtime_error("Пошкоджені дані: обірване число");
+            uint8_t b = *p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        throw runtime_error("Пошкоджені дані: задовге число");
+    }
+    int64_t svarint() { uint64_t v = varint(); return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+    void skip(size_t n) {
+        if (n > remaining()) throw runtime_error("Пошкоджені дані: обірваний блок");
+        p += n;
+    }
+};
+
+// Файл із довільним доступом для зберігання блоків поза пам'яттю
+class BackingFile {
+    FILE* f;
+    mutex m;
+public:
+    explicit BackingFile(FILE* file) : f(file) {}
+    ~BackingFile() { if (f) fclose(f); }
+    BackingFile(const BackingFile&) = delete;
+    BackingFile& operator=(const BackingFile&) = delete;
+
+    // Тимчасовий файл, що видаляється після закриття
+    static shared_ptr<BackingFile> temporary() {
+        FILE* file = tmpfile();
+        if (!file) throw runtime_error("Не вдалося створити тимчасовий файл");
+        return make_shared<BackingFile>(file);
+    }
+    // Файл на диску; mode — як у fopen ("rb", "r+b", "w+b")
+    static shared_ptr<BackingFile> open(const string& path, const char* mode) {
+        FILE* file = fopen(path.c_str(), mode);
+        if (!file) throw runtime_error("Не вдалося відкрити файл " + path);
+        return make_shared<BackingFile>(file);
+    }
+    vector<uint8_t> read(uint64_t offset, uint64_t length) {
+        lock_guard<mutex> lock(m);
+        vector<uint8_t> bytes((size_t)length);
+        if (length == 0) return bytes;
+#ifdef LB5_HAVE_FORK
+        // pread не зсуває позицію дескриптора, спільну з процесом фонового збереження
+        for (size_t done = 0; done < bytes.size(); ) {
+            ssize_t n = pread(fileno(f), bytes.data() + done, bytes.size() - done, (off_t)(offset + done));
+            if (n <= 0) throw runtime_error("Не вдалося прочитати блок з файлу");
+            done += (size_t)n;
+        }
+#else
+        if (fseek(f, (long)offset, SEEK_SET) != 0 || fread(bytes.data(), 1, bytes.size(), f) != bytes.size())
+            throw runtime_error("Не вдалося прочитати блок з файлу");
+#endif
+        return bytes;
+    }
+    // Дописує блок у кінець; повертає його зміщення
+    uint64_t append(const vector<uint8_t>& bytes) {
+        lock_guard<mutex> lock(m);
+        if (fseek(f, 0, SEEK_END) != 0) throw runtime_error("Не вдалося записати блок у файл");
+        uint64_t offset = (uint64_t)ftell(f);
+        if (!bytes.empty() && fwrite(bytes.data(), 1, bytes.size(), f) != bytes.size())
+            throw runtime_error("Не вдалося записати блок у файл");
+        // Дописане має бути видно read, що читає повз буфер stdio
+        if (fflush(f) != 0) throw runtime_error("Не вдалося записати блок у файл");
+        return offset;
+    }
+    // Перезаписує байти з заданого зміщення
+    void write(uint64_t offset, const vector<uint8_t>& bytes) {
+        lock_guard<mutex> lock(m);
+        if (fseek(f, (long)offset, SEEK_SET) != 0 || fwrite(bytes.data(), 1, bytes.size(), f) != bytes.size()
+            || fflush(f) != 0)
+            throw runtime_error("Не вдалося записати блок у файл");
+    }
+    void flush() {
+        lock_guard<mutex> lock(m);
+        if (fflush(f) != 0) throw runtime_error("Не вдалося записати файл на диск");
+    }
+    uint64_t size() {
+        lock_guard<mutex> lock(m);
+        fseek(f, 0, SEEK_END);
+        return (uint64_t)ftell(f);
+    }
+};
+
+class PageManager;
+
+// Група (Composite)
+class Group : public GraphicObject {
+    // Стан замороженої або витісненої на диск групи; виділяється лише для таких груп
+    struct ColdStorage {
+        vector<uint8_t> blob;         // стиснуті діти, якщо вони в пам'яті
+        shared_ptr<BackingFile> file; // або файл, де лежить блок
+        uint64_t offset = 0, length = 0;
+        PageManager* pager = nullptr; // менеджер підкачки, якщо група витісняється
+        atomic<uint64_t> lastAccess{0};
+        mutex thawLock; // різні групи розпаковуються паралельно
+    };
+
+    // Заморожена група зберігає дітей стиснутими (див. SceneCodec), а межі —
+    // у childBounds; діти розпаковуються при першому глибокому доступі
+    mutable SmallVector<Ref<GraphicObject>, 8> children;
+    mutable BBox childBounds; // об'єднання меж дітей у власних координатах групи
+    mutable uint64_t childrenHash = 0; // хеш дітей; позиція самої групи домішується в hash()
+    // Версія складу й вмісту дітей (власне переміщення групи її не змінює);
+    // кеші меж і хешу дійсні, доки збігається записана в них версія
+    uint64_t childrenVersion = version;
+    mutable uint64_t boundsVersion = 0, hashVersion = 0;
+    // Показники всіх нащадків; відомі й для замороженої групи (записані в її заголовку)
+    SubtreeStats descendants;
+    IdRange descendantIds; // як і показники, записаний у заголовку
+    mutable atomic<bool> frozen{false};
+    unique_ptr<ColdStorage> cold;
+    friend class SceneCodec;
+    friend class PageManager;
+    friend class GraphicObject;
+
+    // Версія v для вмісту цієї групи та всіх її предків
+    void propagate(uint64_t v) {
+        for (Group* p = this; p; p = p->parent) p->childrenVersion = p->version = v;
+    }
+    // Дитину obj додано (sign = 1) або вилучено (-1): O(глибини)
+    void adjustStats(const GraphicObject& obj, int sign) {
+        SubtreeStats s = obj.stats();
+        IdRange ids = subtreeIds(obj);
+        for (Group* p = this; p; p = p->parent) {
+            if (sign > 0) {
+                p->descendants += s;
+                p->descendantIds.expand(ids);
+            } else {
+                p->descendants -= s;
+            }
+        }
+    }
+    void ensureThawed() const { if (cold) accessCold(); }
+    void accessCold() const;
+    void thaw() const;
+    // Стиснутий блок дітей (з пам'яті або з файлу)
+    vector<uint8_t> frozenBytes() const;
+public:
+    using Children = SmallVector<Ref<GraphicObject>, 8>;
+    static constexpr ShapeKind shapeKind = ShapeKind::Group;
+    Group(int x = 0, int y = 0) : GraphicObject(shapeKind, x, y) {}
+
+    // Діти змінюються лише цими методами: вони оновлюють версії групи й предків
+    void add(Ref<GraphicObject> obj) {
+        ensureThawed();
+        obj->parent = this;
+        adjustStats(*obj, 1);
+        children.push_back(obj);
+        childrenChanged();
+    }
+    void insert(size_t index, Ref<GraphicObject> obj) {
+        ensureThawed();
+        obj->parent = this;
+        adjustStats(*obj, 1);
+        children.insert(index, obj);
+        childrenChanged();
+    }
+    void remove(size_t index) {
+        ensureThawed();
+        if (children[index]->parent == this) children[index]->parent = nullptr;
+        adjustStats(*children[index], -1);
+        children.erase(index);
+        childrenChanged();
+    }
+
+    // Стискає дітей у компактний блок; false — хтось поза деревом тримає нащадків
+    bool freeze();
+    bool isFrozen() const { return frozen.load(memory_order_acquire); }
+    size_t frozenSize() const { return cold ? cold->blob.size() : 0; }
+    bool isPagedOut() const { return isFrozen() && cold->file != nullptr; }
+
+    uint64_t getChildrenVersion() const { return childrenVersion; }
+    // Змінився склад дітей: нова версія групи та її предків
+    void childrenChanged() { propagate(++versionClock()); }
+
+    void draw(ostream& os, int indent = 0) const override {
+        os << string(indent, '+') << "Group (" << x << ", " << y << ")\n";
+        ensureThawed();
+        for (auto& child : children)
+            child->draw(os, indent + 1);
+    }
+
+    // Як draw, але пропускає дітей, межі яких не перетинають view;
+    // ox, oy — світовий зсув батьківської групи
+    void drawInView(ostream& os, const BBox& view, int ox, int oy, int indent = 0) const {
+        os << string(indent, '+') << "Group (" << x << ", " << y << ")\n";
+        ensureThawed();
+        for (auto& child : children) {
+            if (!child->bounds().translated(ox + x, oy + y).intersects(view)) continue;
+            if (auto grp = shapeCast<Group>(child.get()))
+                grp->drawInView(os, view, ox + x, oy + y, indent + 1);
+            else
+                child->draw(os, indent + 1);
+        }
+    }
+
+    bool containsPoint(int px, int py) const override {
+        if (!bounds().contains(px, py)) return false;
+        ensureThawed();
+        for (auto it = children.rbegin(); it != children.rend(); ++it) {
+            if ((*it)->containsPoint(px - x, py - y))
+                return true;
+        }
+        return false;
+    }
+
+    BBox bounds() const override {
+        if (boundsVersion != childrenVersion) {
+            ensureThawed();
+            childBounds = BBox();
+            for (auto& child : children)
+                childBounds.expand(child->bounds());
+            boundsVersion = childrenVersion;
+        }
+        return childBounds.translated(x, y);
+    }
+
+    Ref<GraphicObject> findDeepest(int px, int py) {
+        ensureThawed();
+        for (auto it = children.rbegin(); it != children.rend(); ++it) {
+            if ((*it)->containsPoint(px - x, py - y)) {
+                if (auto grp = shapeCast<Group>(it->get())) return grp->findDeepest(px - x, py - y);
+                else return *it;
+            }
+        }
+        return Ref<GraphicObject>(this);
+    }
+
+    Ref<GraphicObject> clone() const override {
+        auto newGroup = makeRef<Group>(x, y);
+        ensureThawed();
+        for (auto& child : children)
+            newGroup->add(child->clone());
+        return newGroup;
+    }
+
+    // Хеш дітей перераховується лише після зміни їхньої версії,
+    // тож після зміни оновлюються тільки групи на шляху до неї
+    uint64_t hash() const override {
+        if (hashVersion != childrenVersion) {
+            ensureThawed();
+            uint64_t h = children.size();
+            for (auto& child : children) h = mixHash(h, child->hash());
+            childrenHash = h;
+            hashVersion = childrenVersion;
+        }
+        return mixHash(mixHash(mixHash((uint64_t)kind, (uint32_t)x), (uint32_t)y), childrenHash);
+    }
+
+    SubtreeStats stats() const override {
+        SubtreeStats s = descendants;
+        ++s.byKind[(size_t)shapeKind];
+        return s;
+    }
+    const SubtreeStats& descendantStats() const { return descendants; }
+    const IdRange& descendantIdRange() const { return descendantIds; }
+    // ID вузла разом з ID його нащадків
+    static IdRange subtreeIds(const GraphicObject& obj) {
+        IdRange ids;
+        if (auto g = shapeCast<Group>(&obj)) ids = g->descendantIds;
+        ids.expand(obj.getId());
+        return ids;
+    }
+
+    // Лише для читання: зміни дітей повз add/insert/remove не оновили б версії
+    const Children& getChildren() const { ensureThawed(); return children; }
+    // Діти в пам'яті без підвантаження й позначки доступу (порожньо для замороженої групи)
+    const Children& residentChildren() const { return children; }
+};
+
+inline void GraphicObject::markChanged() {
+    version = ++versionClock();
+    if (parent) parent->propagate(version);
+}
+
+// Кодування піддерев у компактні двійкові записи. Запис об'єкта:
+//   kind, id (різниця з попереднім ID), x, y (вже відносні до групи), далі
+//   коло: радіус; прямокутник: ширина, висота;
+//   група: межі дітей (minX, minY, ширина, висота), показники нащадків (кількість
+//   кіл, прямокутників, груп, площа прямокутників, сума radius²), хеш дітей,
+//   діапазон ID нащадків (кількість значень, 0 — порожній; далі початок відносно
+//   ID групи), довжина блоку дітей, діти.
+// Довжина блоку дозволяє пропустити або відкласти розпаковування групи, а хеш
+// дітей — порівнювати таку групу (див. diffScenes) без розпаковування.
+class SceneCodec {
+public:
+    static void encode(ByteWriter& w, const GraphicObject& obj, int& prevId) {
+        w.varint((uint64_t)obj.getKind());
+        w.svarint((int64_t)obj.getId() - prevId);
+        prevId = obj.getId();
+        w.svarint(obj.getX());
+        w.svarint(obj.getY());
+        if (auto c = shapeCast<Circle>(&obj)) {
+            w.svarint(c->getRadius());
+        } else if (auto r = shapeCast<Rectangle>(&obj)) {
+            w.svarint(r->getWidth());
+            w.svarint(r->getHeight());
+        } else {
+            auto& g = static_cast<const Group&>(obj);
+            BBox b = g.bounds().translated(-g.getX(), -g.getY());
+            w.svarint(b.minX);
+            w.svarint(b.minY);
+            w.varint((uint64_t)b.width());
+            w.varint((uint64_t)b.height());
+            const SubtreeStats& s = g.descendantStats();
+            for (int64_t n : s.byKind) w.varint((uint64_t)n);
+            w.svarint(s.rectArea);
+            w.varint((uint64_t)s.circleR2);
+            g.hash();
+            w.varint(g.childrenHash);
+            const IdRange& ids = g.descendantIds;
+            w.varint(ids.empty() ? 0 : (uint64_t)((int64_t)ids.hi - ids.lo + 1));
+            if (!ids.empty()) w.svarint((int64_t)ids.lo - g.getId());
+            ByteWriter payload;
+            encodeChildren(payload, g);
+            w.varint(payload.size());
+            w.raw(payload.data().data(), payload.size());
+        }
+    }
+
+    // Блок дітей групи; заморожена група віддає свій блок без розпаковування
+    static void encodeChildren(ByteWriter& w, const Group& g) {
+        if (g.isFrozen()) {
+            vector<uint8_t> bytes = g.frozenBytes();
+            w.raw(bytes.data(), bytes.size());
+            return;
+        }
+        int prevId = g.getId();
+        for (auto& child : g.children)
+            encode(w, *child, prevId);
+    }
+
+    // Найбільший виданий ID; резервування ID нащадків, які ще не розпаковано
+    static int lastId() { return GraphicObject::idCounter(); }
+    static void reserveIds(int maxId) {
+        auto& counter = GraphicObject::idCounter();
+        int cur = counter.load(memory_order_relaxed);
+        while (maxId > cur && !counter.compare_exchange_weak(cur, maxId, memory_order_relaxed)) {}
+    }
+
+    // Файл, з якого прочитано буфер декодера, і зміщення початку буфера в ньому
+    struct FileSource {
+        shared_ptr<BackingFile> file;
+        uint64_t offset = 0;
+    };
+
+    // Вкладені групи створюються замороженими: їхні діти розпакуються, коли знадобляться.
+    // Якщо задано src, блоки дітей не копіюються, а лишаються у файлі; тоді r може
+    // містити лише заголовок запису групи без самого блоку.
+    static Ref<GraphicObject> decode(ByteReader& r, int& prevId, const FileSource* src = nullptr) {
+        return decodeRecord(r, prevId, src, false);
+    }
+    // Повне декодування піддерева за один прохід, без проміжних блоків
+    static Ref<GraphicObject> decodeTree(ByteReader& r, int& prevId) {
+        return decodeRecord(r, prevId, nullptr, true);
+    }
+private:
+    static Ref<GraphicObject> decodeRecord(ByteReader& r, int& prevId, const FileSource* src, bool deep) {
+        auto kind = (ShapeKind)r.varint();
+        int id = (int)(prevId + r.svarint());
+        prevId = id;
+        int x = (int)r.svarint(), y = (int)r.svarint();
+        Ref<GraphicObject> obj;
+        if (kind == ShapeKind::Circle) {
+            obj = makeRef<Circle>(x, y, (int)r.svarint());
+        } else if (kind == ShapeKind::Rectangle) {
+            int w = (int)r.svarint();
+            obj = makeRef<Rectangle>(x, y, w, (int)r.svarint());
+        } else if (kind == ShapeKind::Group) {
+            auto g = makeRef<Group>(x, y);
+            int minX = (int)r.svarint(), minY = (int)r.svarint();
+            int w = (int)r.varint(), h = (int)r.varint();
+            g->childBounds = w ? BBox(minX, minY, minX + w - 1, minY + h - 1) : BBox();
+            g->boundsVersion = g->childrenVersion;
+            for (int64_t& n : g->descendants.byKind) n = (int64_t)r.varint();
+            g->descendants.rectArea = r.svarint();
+            g->descendants.circleR2 = (int64_t)r.varint();
+            g->childrenHash = r.varint();
+            g->hashVersion = g->childrenVersion;
+            if (uint64_t span = r.varint()) {
+                g->descendantIds.lo = (int)(id + r.svarint());
+                g->descendantIds.hi = (int)(g->descendantIds.lo + (int64_t)span - 1);
+            }
+            size_t len = r.varint();
+            if (deep) {
+                const uint8_t* start = r.position();
+                r.skip(len);
+                ByteReader sub(start, len);
+                int childPrev = id;
+                while (!sub.atEnd()) {
+                    g->children.push_back(decodeRecord(sub, childPrev, nullptr, true));
+                    g->children.back()->parent = g.get();
+                }
+            } else {
+                g->cold.reset(new Group::ColdStorage);
+                if (src) {
+                    g->cold->file = src->file;
+                    g->cold->offset = src->offset + r.consumed();
+                    g->cold->length = len;
+                    r.skip(min(len, r.remaining()));
+                } else {
+                    const uint8_t* start = r.position();
+                    r.skip(len);
+                    g->cold->blob.assign(start, start + len);
+                }
+                g->frozen.store(true, memory_order_release);
+            }
+            obj = g;
+        } else {
+            throw runtime_error("Пошкоджені дані: невідомий тип об'єкта");
+        }
+        obj->id = id;
+        reserveIds(id);
+        return obj;
+    }
+};
+
+inline vector<uint8_t> Group::frozenBytes() const {
+    return cold->file ? cold->file->read(cold->offset, cold->length) : cold->blob;
+}
+
+inline void Group::thaw() const {
+    lock_guard<mutex> lock(cold->thawLock);
+    if (!frozen.load(memory_order_relaxed)) return;
+    // Блок із файлу: вкладені групи посилаються на свої ділянки того ж файлу
+    SceneCodec::FileSource src{cold->file, cold->offset};
+    vector<uint8_t> bytes = cold->file ? cold->file->read(cold->offset, cold->length) : std::move(cold->blob);
+    ByteReader r(bytes);
+    int prevId = id;
+    // Діти ті самі, що до заморожування, тож версії не змінюються
+    while (!r.atEnd()) {
+        children.push_back(SceneCodec::decode(r, prevId, src.file ? &src : nullptr));
+        children.back()->parent = const_cast<Group*>(this);
+    }
+    vector<uint8_t>().swap(cold->blob);
+    cold->file.reset();
+    frozen.store(false, memory_order_release);
+}
+
+// Чи належать усі нащадки лише дереву (ніхто інший не тримає на них Ref)
+bool uniquelyOwned(const Group& g) {
+    if (g.isFrozen()) return true;
+    for (auto& child : g.getChildren()) {
+        if (child.use_count() != 1) return false;
+        if (auto grp = shapeCast<Group>(child.get()))
+            if (!uniquelyOwned(*grp)) return false;
+    }
+    return true;
+}
+
+inline bool Group::freeze() {
+    if (isFrozen()) return true;
+    if (!uniquelyOwned(*this)) return false;
+    bounds();
+    hash();
+    ByteWriter w;
+    SceneCodec::encodeChildren(w, *this);
+    if (!cold) cold.reset(new ColdStorage);
+    cold->blob = std::move(w.data());
+    cold->blob.shrink_to_fit();
+    children.clear();
+    frozen.store(true, memory_order_release);
+    return true;
+}
+
+// Приблизний обсяг пам'яті піддерева без розпаковування заморожених груп
+size_t residentBytes(const GraphicObject& obj) {
+    auto g = shapeCast<Group>(&obj);
+    if (!g) return shapeCast<Circle>(&obj) ? sizeof(Circle) : sizeof(Rectangle);
+    if (g->isFrozen()) return sizeof(Group) + g->frozenSize();
+    // Оцінка не є зверненням до групи: порядок витіснення не змінюється
+    auto& children = g->residentChildren();
+    size_t bytes = sizeof(Group);
+    if (children.onHeap()) bytes += children.capacity() * sizeof(Ref<GraphicObject>);
+    for (auto& child : children) bytes += residentBytes(*child);
+    return bytes;
+}
+
+// Підкачка піддерев на диск: зареєстровані групи, до яких найдовше не
+// зверталися, витісняються у тимчасовий файл, коли їхній сумарний обсяг
+// перевищує бюджет. У пам'яті лишаються сама група, її межі та зміщення
+// блоку; обхід (findElementAt, draw, clone) підвантажує дітей назад.
+class PageManager {
+    struct Entry {
+        Ref<Group> group;
+        size_t bytes = 0; // оцінка обсягу на момент останнього підвантаження
+    };
+    shared_ptr<BackingFile> swap;
+    unordered_map<int, Entry> entries;
+    atomic<uint64_t> clock{0};
+    size_t budget = 0;
+    size_t evictions = 0;
+    size_t pinned = 0; // груп, які останнє витіснення пропустило через зовнішні посилання
+    atomic<size_t> faults{0};
+public:
+    void setBudget(size_t bytes) { budget = bytes; }
+    size_t getBudget() const { return budget; }
+    size_t evictionCount() const { return evictions; }
+    size_t faultCount() const { return faults; }
+    // На нащадків таких груп посилаються історія дій чи ID-буфер, тож вони
+    // лишаються в пам'яті понад бюджет, доки посилання не зникнуть
+    size_t pinnedCount() const { return pinned; }
+    uint64_t swapSize() { return swap ? swap->size() : 0; }
+
+    void track(const Ref<Group>& g) {
+        if (!g->cold) g->cold.reset(new Group::ColdStorage);
+        g->cold->pager = this;
+        g->cold->lastAccess = ++clock;
+        Entry& e = entries[g->getId()];
+        e.group = g;
+        e.bytes = residentBytes(*g);
+    }
+    // Забуває всі групи (наприклад, після заміни сцени)
+    void reset() { entries.clear(); }
+    void untrack(int id) { entries.erase(id); }
+    void touch(const Group& g) { g.cold->lastAccess.store(++clock, memory_order_relaxed); }
+    void noteFault() { ++faults; }
+
+    size_t residentTotal() const {
+        size_t total = 0;
+        for (auto& e : entries)
+            if (!e.second.group->isPagedOut()) total += e.second.bytes;
+        return total;
+    }
+
+    // Витіснення найдавніше використаних груп; викликається лише між операціями,
+    // коли жоден обхід сцени не виконується
+    void enforceBudget() {
+        pinned = 0;
+        if (budget == 0) return;
+        // Час доступу знімається до будь-якого обходу дерева
+        vector<pair<uint64_t, Entry*>> resident;
+        for (auto& e : entries)
+            if (!e.second.group->isPagedOut())
+                resident.push_back({e.second.group->cold->lastAccess.load(memory_order_relaxed), &e.second});
+        size_t total = 0;
+        for (auto& r : resident) {
+            r.second->bytes = residentBytes(*r.second->group);
+            total += r.second->bytes;
+        }
+        if (total <= budget) return;
+        sort(resident.begin(), resident.end(), [](const pair<uint64_t, Entry*>& a, const pair<uint64_t, Entry*>& b) {
+            return a.first < b.first;
+        });
+        if (!swap) swap = BackingFile::temporary();
+        for (auto& r : resident) {
+            Entry* e = r.second;
+            if (total <= budget) break;
+            Group& g = *e->group;
+            if (!g.freeze()) { ++pinned; continue; } // на нащадків посилаються ззовні
+            g.cold->length = g.cold->blob.size();
+            g.cold->offset = swap->append(g.cold->blob);
+            g.cold->file = swap;
+            vector<uint8_t>().swap(g.cold->blob);
+            total -= e->bytes;
+            e->bytes = residentBytes(g);
+            ++evictions;
+        }
+    }
 };
 
-// Коло
-class Circle : public GraphicObject {
-    int radius;
+inline void Group::accessCold() const {
+    if (cold->pager) cold->pager->touch(*this);
+    if (frozen.load(memory_order_acquire)) {
+        if (cold->pager && cold->file) cold->pager->noteFault();
+        thaw();
+    }
+}
+
+// Файл сцени:
+//   заголовок фіксованої довжини: "LB5S", версія (u32), зміщення таблиці (u64);
+//   записи об'єктів верхнього рівня (SceneCodec, ID відносно 0);
+//   таблиця в кінці файлу: кількість записів, найбільший ID, (зміщення, довжина) кожного.
+// При лінивому відкритті читаються лише таблиця та заголовки записів: групи
+// посилаються на свої блоки у файлі й розпаковуються при першому обході.
+class SceneFile {
+    static constexpr char magic[4] = {'L', 'B', '5', 'S'};
+    // 2 — показники нащадків у заголовках груп, 3 — хеш дітей, 4 — діапазон ID нащадків
+    static constexpr uint32_t version = 4;
+    static constexpr size_t headerSize = 16;
+    // Заголовок запису групи: тип, ID, x, y, межі, показники, хеш, діапазон ID,
+    // довжина блоку — до 135 байт
+    static constexpr size_t recordHeaderMax = 160;
+    // Записи пишуться й читаються блоками такого розміру, а не по одному
+    static constexpr size_t ioBlock = 1 << 20;
+
+    static vector<uint8_t> header(uint64_t tableOffset) {
+        vector<uint8_t> h(magic, magic + 4);
+        for (int i = 0; i < 4; ++i) h.push_back((uint8_t)(version >> (8 * i)));
+        for (int i = 0; i < 8; ++i) h.push_back((uint8_t)(tableOffset >> (8 * i)));
+        return h;
+    }
+    // Перевіряє заголовок; повертає зміщення таблиці
+    static uint64_t readHeader(BackingFile& file, uint64_t fileSize) {
+        if (fileSize < headerSize) throw runtime_error("Файл не є сценою LB5");
+        vector<uint8_t> h = file.read(0, headerSize);
+        if (!equal(magic, magic + 4, h.begin())) throw runtime_error("Файл не є сценою LB5");
+        uint32_t ver = 0;
+        uint64_t tableOffset = 0;
+        for (int i = 0; i < 4; ++i) ver |= (uint32_t)h[4 + i] << (8 * i);
+        for (int i = 0; i < 8; ++i) tableOffset |= (uint64_t)h[8 + i] << (8 * i);
+        if (ver != version) throw runtime_error("Непідтримувана версія файлу сцени");
+        if (tableOffset < headerSize || tableOffset > fileSize) throw runtime_error("Пошкоджені дані: таблиця записів");
+        return tableOffset;
+    }
+public:
+    struct Chunk {
+        uint64_t offset, length;
+        uint64_t version = 0; // версія об'єкта, яку описує запис (у файл не пишеться)
+    };
+    // Записи у файлі за ID об'єкта верхнього рівня; запис застарів, якщо
+    // об'єкта немає або його версія відрізняється
+    using ChunkIndex = unordered_map<int, Chunk>;
+    static bool current(const ChunkIndex& index, const GraphicObject& obj) {
+        auto it = index.find(obj.getId());
+        return it != index.end() && it->second.version == obj.getVersion();
+    }
+    struct SaveStats {
+        uint64_t written = 0; // скільки байт записано
+        bool full = false;    // файл переписано цілком
+    };
+    // Викликається після кожного записаного блоку: скільки об'єктів із total готово
+    using Progress = function<void(size_t done, size_t total)>;
+
+private:
+    // Дописує в кінець файлу записи об'єктів по одному; для об'єктів з актуальним
+    // записом в index бере готовий. Записи збираються в блоки по ioBlock байт.
+    class Appender {
+        BackingFile& file;
+        ChunkIndex& index;
+        SaveStats& stats;
+        vector<Chunk> table;
+        ByteWriter block;
+        uint64_t blockStart;
+    public:
+        Appender(BackingFile& file, ChunkIndex& index, SaveStats& stats, size_t expected)
+            : file(file), index(index), stats(stats), blockStart(file.size()) {
+            table.reserve(expected);
+        }
+        // true — після цього об'єкта блок записано у файл
+        bool append(const GraphicObject& obj) {
+            if (current(index, obj)) {
+                table.push_back(index[obj.getId()]);
+            } else {
+                uint64_t offset = blockStart + block.size();
+                int prevId = 0;
+                SceneCodec::encode(block, obj, prevId);
+                table.push_back({offset, blockStart + block.size() - offset, obj.getVersion()});
+                index[obj.getId()] = table.back();
+            }
+            if (block.size() < ioBlock) return false;
+            file.append(block.data());
+            stats.written += block.size();
+            blockStart += block.size();
+            block.data().clear();
+            return true;
+        }
+        // Дописує залишок блоку й нову таблицю (вона переписується щоразу: кілька
+        // байт на об'єкт верхнього рівня); index після цього описує рівно objects.
+        // Повертає зміщення таблиці.
+        uint64_t finish(const vector<Ref<GraphicObject>>& objects) {
+            file.append(block.data());
+            stats.written += block.size();
+            ByteWriter t;
+            t.varint(table.size());
+            t.varint((uint64_t)SceneCodec::lastId());
+            for (auto& c : table) {
+                t.varint(c.offset);
+                t.varint(c.length);
+            }
+            stats.written += t.size();
+            // Записи видалених об'єктів більше не знадобляться
+            if (index.size() > objects.size()) {
+                ChunkIndex live;
+                for (size_t i = 0; i < objects.size(); ++i) live[objects[i]->getId()] = table[i];
+                index = std::move(live);
+            }
+            return file.append(t.data());
+        }
+    };
+public:
+    // Повний запис порціями: step кодує об'єкти, доки не набереться блок. Файл
+    // пишеться поруч і підміняє наявний лише в commit (ліниві групи можуть читати
+    // старий), тож перерваний через abort запис нічого не псує.
+    class Writer {
+        string path, tmp;
+        vector<Ref<GraphicObject>> objects; // знімок списку верхнього рівня
+        shared_ptr<BackingFile> file;
+        ChunkIndex index;
+        SaveStats stats;
+        unique_ptr<Appender> appender;
+        size_t next = 0;
+    public:
+        Writer(const string& path, const vector<Ref<GraphicObject>>& objects)
+            : path(path), tmp(path + ".tmp"), objects(objects) {
+            stats.full = true;
+            file = BackingFile::open(tmp, "w+b");
+            file->append(header(0));
+            appender.reset(new Appender(*file, index, stats, objects.size()));
+        }
+        ~Writer() { abort(); }
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+
+        // false — усі записи закодовано, лишився commit
+        bool step() {
+            while (next < objects.size())
+                if (appender->append(*objects[next++])) break;
+            return next < objects.size();
+        }
+        size_t done() const { return next; }
+        size_t total() const { return objects.size(); }
+
+        // Дописує таблицю й підміняє файл; index (якщо задано) — розташування записів
+        SaveStats commit(ChunkIndex* out = nullptr) {
+            while (step()) {}
+            file->write(0, header(appender->finish(objects)));
+            file->flush();
+            stats.written += headerSize;
+            appender.reset();
+            file.reset();
+            if (rename(tmp.c_str(), path.c_str()) != 0) {
+                // Windows не підміняє наявний файл
+                remove(path.c_str());
+                if (rename(tmp.c_str(), path.c_str()) != 0)
+                    throw runtime_error("Не вдалося замінити файл " + path);
+            }
+            if (out) *out = std::move(index);
+            return stats;
+        }
+        // Припиняє запис і видаляє тимчасовий файл
+        void abort() {
+            if (!file) return;
+            appender.reset();
+            file.reset();
+            remove(tmp.c_str());
+        }
+    };
+
+    // Повний запис; index (якщо задано) заповнюється розташуванням записів
+    static SaveStats save(const string& path, const vector<Ref<GraphicObject>>& objects, ChunkIndex* index = nullptr,
+                          const Progress& progress = nullptr) {
+        Writer w(path, objects);
+        while (w.step())
+            if (progress) progress(w.done(), w.total());
+        return w.commit(index);
+    }
+
+    // Дозапис у файл, з якого завантажено або куди востаннє збережено сцену:
+    // дописуються лише змінені записи й нова таблиця, після чого заголовок
+    // перемикається на неї (до цього файл лишається цілісним зі старою таблицею).
+    // Одиниця дозапису — об'єкт верхнього рівня: зміна будь-якого нащадка групи
+    // (навіть одного кола глибоко всередині) переписує запис групи цілком, тож
+    // великі групи варто ділити на менші, якщо їх часто редагують.
+    // Коли старі записи займають більше половини файлу, він ущільнюється повним записом.
+    static SaveStats update(const string& path, const vector<Ref<GraphicObject>>& objects, ChunkIndex& index) {
+        shared_ptr<BackingFile> file;
+        uint64_t fileSize = 0;
+        try {
+            file = BackingFile::open(path, "r+b");
+            fileSize = file->size();
+            readHeader(*file, fileSize);
+        } catch (const runtime_error&) {
+            return save(path, objects, &index);
+        }
+        uint64_t reused = 0;
+        for (auto& obj : objects)
+            if (current(index, *obj)) reused += index[obj->getId()].length;
+        if (fileSize > 2 * (reused + headerSize) + ioBlock) {
+            file.reset();
+            return save(path, objects, &index);
+        }
+        SaveStats stats;
+        Appender appender(*file, index, stats, objects.size());
+        for (auto& obj : objects) appender.append(*obj);
+        uint64_t tableOffset = appender.finish(objects);
+        file->flush();
+        file->write(0, header(tableOffset));
+        file->flush();
+        stats.written += headerSize;
+        return stats;
+    }
+
+    // lazy = false — сцена читається й розпаковується повністю у threads потоків
+    // (0 — за кількістю ядер); index (якщо задано) заповнюється розташуванням записів
+    static vector<Ref<GraphicObject>> load(const string& path, bool lazy, unsigned threads = 0,
+                                           ChunkIndex* index = nullptr) {
+        auto file = BackingFile::open(path, "rb");
+        uint64_t fileSize = file->size();
+        uint64_t tableOffset = readHeader(*file, fileSize);
+
+        vector<uint8_t> t = file->read(tableOffset, fileSize - tableOffset);
+        ByteReader r(t);
+        size_t count = r.varint();
+        int maxId = (int)r.varint();
+        if (count > r.remaining()) throw runtime_error("Пошкоджені дані: таблиця записів");
+        vector<Chunk> table(count);
+        for (auto& c : table) {
+            c = {r.varint(), r.varint()};
+            if (c.offset < headerSize || c.length > tableOffset || c.offset > tableOffset - c.length)
+                throw runtime_error("Пошкоджені дані: запис поза файлом");
+        }
+        // Нерозпаковані нащадки не повинні отримати ID нових об'єктів
+        SceneCodec::reserveIds(maxId);
+
+        vector<Ref<GraphicObject>> objects(count);
+        if (lazy) {
+            // Заголовки сусідніх записів читаються спільним вікном
+            vector<uint8_t> window;
+            uint64_t windowStart = 0;
+            for (size_t i = 0; i < count; ++i) {
+                const Chunk& c = table[i];
+                uint64_t need = min<uint64_t>(c.length, recordHeaderMax);
+                if (c.offset < windowStart || c.offset + need > windowStart + window.size()) {
+                    windowStart = c.offset;
+                    window = file->read(c.offset, min<uint64_t>(max<uint64_t>(need, ioBlock), tableOffset - c.offset));
+                }
+                ByteReader cr(window.data() + (c.offset - windowStart), (size_t)need);
+                int prevId = 0;
+                SceneCodec::FileSource src{file, c.offset};
+                objects[i] = SceneCodec::decode(cr, prevId, &src);
+            }
+        } else {
+            decodeParallel(*file, tableOffset, table, objects, threads);
+        }
+        if (index) {
+            index->clear();
+            for (size_t i = 0; i < count; ++i) {
+                table[i].version = objects[i]->getVersion();
+                (*index)[objects[i]->getId()] = table[i];
+            }
+        }
+        return objects;
+    }
+
+private:
+    // Записи незалежні: тіло файлу читається одним блоком, записи
+    // декодуються паралельно й стають на свої місця в objects.
+    // Кожне піддерево створює й тримає лише один потік до join.
+    static void decodeParallel(BackingFile& file, uint64_t tableOffset, const vector<Chunk>& table,
+                               vector<Ref<GraphicObject>>& objects, unsigned threads) {
+        size_t count = table.size();
+        vector<uint8_t> body = file.read(headerSize, tableOffset - headerSize);
+        atomic<size_t> next(0);
+        mutex errorMutex;
+        exception_ptr error;
+        auto worker = [&]() {
+            try {
+                for (size_t i; (i = next++) < count; ) {
+                    ByteReader cr(body.data() + (table[i].offset - headerSize), (size_t)table[i].length);
+                    int prevId = 0;
+                    objects[i] = SceneCodec::decodeTree(cr, prevId);
+                }
+            } catch (...) {
+                lock_guard<mutex> lock(errorMutex);
+                if (!error) error = current_exception();
+                next = count;
+            }
+        };
+        if (threads == 0) threads = max(1u, thread::hardware_concurrency());
+        vector<thread> pool;
+        for (size_t i = 1; i < min<size_t>(threads, count); ++i) pool.emplace_back(worker);
+        worker();
+        for (auto& th : pool) th.join();
+        if (error) rethrow_exception(error);
+    }
+};
+
+// Обхід листків у порядку малювання (пізніші перекривають попередні).
+// ox, oy — накопичений зсув батьківських груп; гілки поза region пропускаються.
+void forEachLeaf(const Ref<GraphicObject>& obj, int ox, int oy, const BBox& region,
+                 const function<void(const Ref<GraphicObject>&, int, int)>& visit) {
+    if (!obj->bounds().translated(ox, oy).intersects(region)) return;
+    auto grp = shapeCast<Group>(obj.get());
+    if (!grp) { visit(obj, ox, oy); return; }
+    for (auto& child : grp->getChildren())
+        forEachLeaf(child, ox + grp->getX(), oy + grp->getY(), region, visit);
+}
+
+// Пошук найглибшого верхнього об'єкта в точці обходом ієрархії
+Ref<GraphicObject> hitTest(const vector<Ref<GraphicObject>>& objects, int x, int y) {
+    for (auto it = objects.rbegin(); it != objects.rend(); ++it) {
+        if ((*it)->containsPoint(x, y)) {
+            if (auto grp = shapeCast<Group>(it->get())) return grp->findDeepest(x, y);
+            else return *it;
+        }
+    }
+    return nullptr;
+}
+
+// Просторовий індекс над знімком меж об'єктів верхнього рівня. Запити повертають
+// позиції прямокутників у знімку (у довільному порядку, без повторів).
+class SpatialIndex {
+public:
+    virtual ~SpatialIndex() = default;
+    virtual const char* name() const = 0;
+    // stop дозволяє перервати побудову; false — перервано, індекс непридатний
+    virtual bool build(vector<BBox> snapshot, const atomic<bool>* stop = nullptr) = 0;
+    // Прямокутники, що містять точку
+    virtual void query(int x, int y, vector<uint32_t>& out) const = 0;
+    // Прямокутники, що перетинають region
+    virtual void query(const BBox& region, vector<uint32_t>& out) const = 0;
+};
+
+// Ієрархія обмежувальних прямокутників (BVH). Будується згори вниз: вузол ділиться площиною, вибраною за евристикою
+// площ поверхонь (SAH) серед меж кошиків центрів уздовж довшої осі; великі
+// піддерева будуються в окремих потоках. Вузли лежать в одному масиві, діти
+// внутрішнього вузла — поруч (first і first + 1).
+class BoundingVolumeHierarchy : public SpatialIndex {
+    struct Node {
+        BBox bounds;
+        uint32_t first = 0; // лист — перший елемент у items, інакше — лівий нащадок
+        uint32_t count = 0; // 0 — внутрішній вузол
+    };
+    vector<Node> nodes;
+    vector<uint32_t> items; // індекси прямокутників знімка, згруповані по листках
+    vector<BBox> boxes;
+    unsigned threads;
+
+    static constexpr uint32_t leafSize = 4;
+    static constexpr int binCount = 16;
+    static constexpr int maxDepth = 48; // глибше — поділ навпіл за медіаною
+    // Розмір піддерева, з якого його варто будувати в окремому потоці
+    static constexpr uint32_t parallelSize = 1u << 15;
+
+    // 2D-аналог площі поверхні: півпериметр
+    static int64_t cost(const BBox& b) { return b.empty() ? 0 : (int64_t)b.width() + b.height(); }
+    // Подвоєний центр, щоб не мати дробів
+    static int center(const BBox& b, int axis) { return axis ? b.minY + b.maxY : b.minX + b.maxX; }
+
+    struct Builder {
+        BoundingVolumeHierarchy& tree;
+        atomic<uint32_t> nextNode{1};
+        atomic<int> spareThreads;
+        const atomic<bool>* stop;
+
+        void build(uint32_t node, uint32_t begin, uint32_t end, int depth) {
+            if (stop && stop->load(memory_order_relaxed)) return;
+            auto& items = tree.items;
+            auto& boxes = tree.boxes;
+            BBox bounds, centers;
+            for (uint32_t i = begin; i < end; ++i) {
+                const BBox& b = boxes[items[i]];
+                bounds.expand(b);
+                centers.expand(BBox(b.minX + b.maxX, b.minY + b.maxY, b.minX + b.maxX, b.minY + b.maxY));
+            }
+            Node& n = tree.nodes[node];
+            n.bounds = bounds;
+            int axis = centers.width() >= centers.height() ? 0 : 1;
+            int lo = axis ? centers.minY : centers.minX;
+            int64_t extent = (int64_t)(axis ? centers.height() : centers.width());
+            if (end - begin <= leafSize || extent <= 1) {
+                n.first = begin;
+                n.count = end - begin;
+                return;
+            }
+
+            uint32_t mid;
+            if (depth < maxDepth) {
+                auto binOf = [&](uint32_t item) {
+                    return (int)(((int64_t)center(boxes[item], axis) - lo) * binCount / extent);
+                };
+                BBox binBounds[binCount];
+                uint32_t binItems[binCount] = {};
+                for (uint32_t i = begin; i < end; ++i) {
+                    int k = binOf(items[i]);
+                    binBounds[k].expand(boxes[items[i]]);
+                    ++binItems[k];
+                }
+                // Вартість поділу перед кошиком k: ліві межі накопичуються прямим
+                // проходом, праві — зворотним
+                int64_t leftCost[binCount];
+                BBox acc;
+                uint32_t seen = 0;
+                for (int k = 0; k < binCount; ++k) {
+                    leftCost[k] = cost(acc) * seen;
+                    acc.expand(binBounds[k]);
+                    seen += binItems[k];
+                }
+                int best = -1;
+                int64_t bestCost = numeric_limits<int64_t>::max();
+                acc = BBox();
+                seen = 0;
+                for (int k = binCount - 1; k > 0; --k) {
+                    acc.expand(binBounds[k]);
+                    seen += binItems[k];
+                    if (seen == 0 || seen == end - begin) continue;
+                    int64_t c = leftCost[k] + cost(acc) * seen;
+                    if (c < bestCost) { bestCost = c; best = k; }
+                }
+                mid = (uint32_t)(partition(items.begin() + begin, items.begin() + end,
+                                           [&](uint32_t item) { return binOf(item) < best; }) - items.begin());
+            } else {
+                mid = begin + (end - begin) / 2;
+                nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+                            [&](uint32_t a, uint32_t b) { return center(boxes[a], axis) < center(boxes[b], axis); });
+            }
+
+            uint32_t left = nextNode.fetch_add(2);
+            n.first = left;
+            n.count = 0;
+            if (end - begin >= parallelSize && spareThreads.fetch_sub(1) > 0) {
+                thread worker([this, left, begin, mid, depth] { build(left, begin, mid, depth + 1); });
+                build(left + 1, mid, end, depth + 1);
+                worker.join();
+                ++spareThreads;
+            } else {
+                if (end - begin >= parallelSize) ++spareThreads;
+                build(left, begin, mid, depth + 1);
+                build(left + 1, mid, end, depth + 1);
+            }
+        }
+    };
+public:
+    // threads — потоки побудови, 0 — за кількістю ядер
+    explicit BoundingVolumeHierarchy(unsigned threads = 0)
+        : threads(threads ? threads : max(1u, thread::hardware_concurrency())) {}
+    const char* name() const override { return "BVH"; }
+
+    bool build(vector<BBox> snapshot, const atomic<bool>* stop = nullptr) override {
+        boxes = std::move(snapshot);
+        items.resize(boxes.size());
+        for (uint32_t i = 0; i < items.size(); ++i) items[i] = i;
+        nodes.assign(max<size_t>(1, 2 * boxes.size()), Node());
+        Builder b{*this, {1}, {(int)threads - 1}, stop};
+        if (!boxes.empty()) b.build(0, 0, (uint32_t)boxes.size(), 0);
+        nodes.resize(b.nextNode);
+        nodes.shrink_to_fit();
+        return !stop || !stop->load();
+    }
+
+    size_t nodeCount() const { return nodes.size(); }
+
+    void query(int x, int y, vector<uint32_t>& out) const override {
+        visit([&](const BBox& b) { return b.contains(x, y); }, out);
+    }
+    void query(const BBox& region, vector<uint32_t>& out) const override {
+        visit([&](const BBox& b) { return b.intersects(region); }, out);
+    }
+private:
+    template <class Test>
+    void visit(const Test& test, vector<uint32_t>& out) const {
+        out.clear();
+        if (boxes.empty()) return;
+        // Глибина не перевищує maxDepth + log2(розміру), а стек росте на вузол за рівень
+        uint32_t stack[maxDepth + 64];
+        size_t top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& n = nodes[stack[--top]];
+            if (!test(n.bounds)) continue;
+            if (n.count) {
+                for (uint32_t k = n.first; k < n.first + n.count; ++k)
+                    if (test(boxes[items[k]])) out.push_back(items[k]);
+                continue;
+            }
+            stack[top++] = n.first + 1;
+            stack[top++] = n.first;
+        }
+    }
+};
+
+// Рівномірна сітка: клітинка — близько двох середніх розмірів об'єкта, списки
+// клітинок лежать підряд в одному масиві. Об'єкти, що накрили б забагато
+// клітинок, зберігаються окремо й перевіряються в кожному запиті.
+class UniformGrid : public SpatialIndex {
+    BBox extent;
+    int cellSize = 1, columns = 0, rows = 0;
+    vector<uint32_t> cellStart; // список клітинки c — items[cellStart[c], cellStart[c + 1])
+    vector<uint32_t> items;
+    vector<uint32_t> oversized;
+    vector<BBox> boxes;
+
+    static constexpr int maxCellsPerItem = 64;
+
+    int column(int x) const { return (int)(((int64_t)x - extent.minX) / cellSize); }
+    int row(int y) const { return (int)(((int64_t)y - extent.minY) / cellSize); }
+    // Клітинки, які накриває b (у межах сітки)
+    void cells(const BBox& b, int& c0, int& r0, int& c1, int& r1) const {
+        BBox clipped = b.intersect(extent);
+        c0 = column(clipped.minX);
+        r0 = row(clipped.minY);
+        c1 = column(clipped.maxX);
+        r1 = row(clipped.maxY);
+    }
+public:
+    const char* name() const override { return "сітка"; }
+
+    bool build(vector<BBox> snapshot, const atomic<bool>* stop = nullptr) override {
+        boxes = std::move(snapshot);
+        extent = BBox();
+        double side = 0;
+        for (auto& b : boxes) {
+            extent.expand(b);
+            side += (b.width() + b.height()) / 2.0;
+        }
+        cellStart.assign(1, 0);
+        items.clear();
+        oversized.clear();
+        columns = rows = 0;
+        if (extent.empty()) return true;
+        // Не більше чотирьох клітинок на об'єкт: інакше сітка здебільшого порожня
+        cellSize = max(1, (int)min(1e9, 2 * side / boxes.size()));
+        auto fits = [&] {
+            int64_t c = ((int64_t)extent.width() + cellSize - 1) / cellSize;
+            int64_t r = ((int64_t)extent.height() + cellSize - 1) / cellSize;
+            if ((double)c * r > 4.0 * boxes.size() + 16) return false;
+            columns = (int)c;
+            rows = (int)r;
+            return true;
+        };
+        while (!fits()) cellSize = cellSize > (1 << 29) ? (1 << 30) : cellSize * 2;
+
+        // Два проходи: підрахунок розмірів списків, потім заповнення
+        vector<uint32_t> fill((size_t)columns * rows + 1, 0);
+        vector<uint8_t> large(boxes.size(), 0);
+        for (uint32_t i = 0; i < boxes.size(); ++i) {
+            int c0, r0, c1, r1;
+            cells(boxes[i], c0, r0, c1, r1);
+            if ((int64_t)(c1 - c0 + 1) * (r1 - r0 + 1) > maxCellsPerItem) {
+                large[i] = 1;
+                oversized.push_back(i);
+                continue;
+            }
+            for (int r = r0; r <= r1; ++r)
+                for (int c = c0; c <= c1; ++c) ++fill[(size_t)r * columns + c + 1];
+        }
+        if (stop && stop->load()) return false;
+        for (size_t c = 1; c < fill.size(); ++c) fill[c] += fill[c - 1];
+        cellStart = fill;
+        items.resize(fill.back());
+        for (uint32_t i = 0; i < boxes.size(); ++i) {
+            if (large[i]) continue;
+            int c0, r0, c1, r1;
+            cells(boxes[i], c0, r0, c1, r1);
+            for (int r = r0; r <= r1; ++r)
+                for (int c = c0; c <= c1; ++c) items[fill[(size_t)r * columns + c]++] = i;
+        }
+        return !stop || !stop->load();
+    }
+
+    void query(int x, int y, vector<uint32_t>& out) const override {
+        out.clear();
+        if (extent.contains(x, y)) {
+            size_t c = (size_t)row(y) * columns + column(x);
+            for (uint32_t k = cellStart[c]; k < cellStart[c + 1]; ++k)
+                if (boxes[items[k]].contains(x, y)) out.push_back(items[k]);
+        }
+        for (uint32_t i : oversized)
+            if (boxes[i].contains(x, y)) out.push_back(i);
+    }
+    void query(const BBox& region, vector<uint32_t>& out) const override {
+        out.clear();
+        if (region.intersects(extent)) {
+            int c0, r0, c1, r1;
+            cells(region, c0, r0, c1, r1);
+            for (int r = r0; r <= r1; ++r)
+                for (int c = c0; c <= c1; ++c) {
+                    size_t cell = (size_t)r * columns + c;
+                    for (uint32_t k = cellStart[cell]; k < cellStart[cell + 1]; ++k)
+                        if (boxes[items[k]].intersects(region)) out.push_back(items[k]);
+                }
+            // Об'єкт, що накриває кілька клітинок, трапляється в кожній з них
+            sort(out.begin(), out.end());
+            out.erase(unique(out.begin(), out.end()), out.end());
+        }
+        for (uint32_t i : oversized)
+            if (boxes[i].intersects(region)) out.push_back(i);
+    }
+};
+
+// Квадродерево: вузол ділить свою область на чотири чверті, об'єкт зберігається
+// в найменшому вузлі, який містить його цілком (великі й ті, що перетинають межі
+// чвертей, лишаються вище). Діти вузла — чотири поспіль у масиві вузлів.
+class Quadtree : public SpatialIndex {
+    struct Node {
+        BBox area;
+        uint32_t child = 0; // 0 — лист
+        uint32_t first = 0, count = 0; // власні об'єкти — items[first, first + count)
+    };
+    vector<Node> nodes;
+    vector<uint32_t> items;
+    vector<BBox> boxes;
+
+    static constexpr uint32_t leafCapacity = 8;
+    static constexpr int maxDepth = 24;
+
+    // Чверть area, яка цілком містить b; -1 — жодна
+    static int quadrant(const BBox& area, const BBox& b) {
+        int midX = area.minX + (int)(((int64_t)area.maxX - area.minX) / 2);
+        int midY = area.minY + (int)(((int64_t)area.maxY - area.minY) / 2);
+        int qx = b.maxX <= midX ? 0 : (b.minX > midX ? 1 : -1);
+        int qy = b.maxY <= midY ? 0 : (b.minY > midY ? 1 : -1);
+        return qx < 0 || qy < 0 ? -1 : qy * 2 + qx;
+    }
+    static BBox quarter(const BBox& area, int q) {
+        int midX = area.minX + (int)(((int64_t)area.maxX - area.minX) / 2);
+        int midY = area.minY + (int)(((int64_t)area.maxY - area.minY) / 2);
+        return BBox(q & 1 ? midX + 1 : area.minX, q & 2 ? midY + 1 : area.minY,
+                    q & 1 ? area.maxX : midX, q & 2 ? area.maxY : midY);
+    }
+
+    // items[begin, end) лежать в області вузла; власні об'єкти переставляються на початок
+    bool build(uint32_t node, uint32_t begin, uint32_t end, int depth, vector<uint32_t>& scratch,
+               const atomic<bool>* stop) {
+        if (stop && stop->load(memory_order_relaxed)) return false;
+        BBox area = nodes[node].area;
+        if (end - begin <= leafCapacity || depth == maxDepth || (area.width() < 2 && area.height() < 2)) {
+            nodes[node].first = begin;
+            nodes[node].count = end - begin;
+            return true;
+        }
+        // Стабільний розклад за чвертями: власні, потім чверті 0..3
+        uint32_t bucket[6] = {};
+        for (uint32_t i = begin; i < end; ++i) ++bucket[quadrant(area, boxes[items[i]]) + 2];
+        for (int q = 1; q < 6; ++q) bucket[q] += bucket[q - 1];
+        uint32_t split[6];
+        copy(bucket, bucket + 6, split);
+        scratch.resize(end - begin);
+        for (uint32_t i = begin; i < end; ++i) scratch[bucket[quadrant(area, boxes[items[i]]) + 1]++] = items[i];
+        copy(scratch.begin(), scratch.end(), items.begin() + begin);
+
+        uint32_t child = (uint32_t)nodes.size();
+        nodes.resize(nodes.size() + 4);
+        nodes[node].child = child;
+        nodes[node].first = begin;
+        nodes[node].count = split[1];
+        for (int q = 0; q < 4; ++q) {
+            nodes[child + q].area = quarter(area, q);
+            if (!build(child + q, begin + split[q + 1], begin + split[q + 2], depth + 1, scratch, stop)) return false;
+        }
+        return true;
+    }
+public:
+    const char* name() const override { return "квадродерево"; }
+
+    bool build(vector<BBox> snapshot, const atomic<bool>* stop = nullptr) override {
+        boxes = std::move(snapshot);
+        items.resize(boxes.size());
+        for (uint32_t i = 0; i < items.size(); ++i) items[i] = i;
+        BBox extent;
+        for (auto& b : boxes) extent.expand(b);
+        nodes.assign(1, Node());
+        nodes[0].area = extent;
+        vector<uint32_t> scratch;
+        return build(0, 0, (uint32_t)items.size(), 0, scratch, stop);
+    }
+
+    void query(int x, int y, vector<uint32_t>& out) const override {
+        out.clear();
+        if (!nodes[0].area.contains(x, y)) return;
+        // Точка лежить рівно в одній чверті, тож обхід — один шлях донизу
+        for (uint32_t i = 0;;) {
+            const Node& n = nodes[i];
+            for (uint32_t k = n.first; k < n.first + n.count; ++k)
+                if (boxes[items[k]].contains(x, y)) out.push_back(items[k]);
+            if (!n.child) return;
+            int q = quadrant(n.area, BBox(x, y, x, y));
+            i = n.child + q;
+        }
+    }
+    void query(const BBox& region, vector<uint32_t>& out) const override {
+        out.clear();
+        vector<uint32_t> stack{0};
+        while (!stack.empty()) {
+            const Node& n = nodes[stack.back()];
+            stack.pop_back();
+            if (!n.area.intersects(region)) continue;
+            for (uint32_t k = n.first; k < n.first + n.count; ++k)
+                if (boxes[items[k]].intersects(region)) out.push_back(items[k]);
+            if (n.child)
+                for (uint32_t q = 0; q < 4; ++q) stack.push_back(n.child + q);
+        }
+    }
+};
+
+enum class SpatialIndexKind { Auto, Grid, Quadtree, Bvh };
+
+// Розподіл меж об'єктів, за яким вибирається індекс
+struct SpatialProfile {
+    size_t count = 0;
+    double meanSide = 0;   // середня сторона межі
+    double largeShare = 0; // частка об'єктів, більших за вісім середніх сторін
+    double occupancy = 0;  // частка непорожніх клітинок грубої сітки (≈4 об'єкти на клітинку)
+
+    static SpatialProfile of(const vector<BBox>& boxes) {
+        SpatialProfile p;
+        p.count = boxes.size();
+        if (boxes.empty()) return p;
+        BBox extent;
+        for (auto& b : boxes) {
+            extent.expand(b);
+            p.meanSide += (b.width() + b.height()) / 2.0;
+        }
+        p.meanSide /= boxes.size();
+        int cells = max(1, (int)sqrt(boxes.size() / 4.0));
+        vector<uint8_t> used((size_t)cells * cells, 0);
+        size_t large = 0;
+        for (auto& b : boxes) {
+            if (max(b.width(), b.height()) > 8 * p.meanSide) ++large;
+            int cx = (int)(((int64_t)b.minX + b.maxX - 2 * (int64_t)extent.minX) * cells / (2 * (int64_t)extent.width()));
+            int cy = (int)(((int64_t)b.minY + b.maxY - 2 * (int64_t)extent.minY) * cells / (2 * (int64_t)extent.height()));
+            used[(size_t)cy * cells + cx] = 1;
+        }
+        p.largeShare = (double)large / boxes.size();
+        p.occupancy = (double)count_if(used.begin(), used.end(), [](uint8_t u) { return u != 0; }) / used.size();
+        return p;
+    }
+
+    // Рівномірно щільні сцени з об'єктами схожого розміру — сітка; скупчення
+    // з великими порожнечами — BVH; проміжні — квадродерево
+    SpatialIndexKind choose() const {
+        if (occupancy >= 0.7 && largeShare < 0.01) return SpatialIndexKind::Grid;
+        if (occupancy < 0.3) return SpatialIndexKind::Bvh;
+        return SpatialIndexKind::Quadtree;
+    }
+};
+
+// Порожній індекс вибраного типу; Auto — за профілем boxes
+unique_ptr<SpatialIndex> makeSpatialIndex(SpatialIndexKind kind, const vector<BBox>& boxes) {
+    if (kind == SpatialIndexKind::Auto) kind = SpatialProfile::of(boxes).choose();
+    switch (kind) {
+        case SpatialIndexKind::Grid: return unique_ptr<SpatialIndex>(new UniformGrid);
+        case SpatialIndexKind::Quadtree: return unique_ptr<SpatialIndex>(new Quadtree);
+        default: return unique_ptr<SpatialIndex>(new BoundingVolumeHierarchy);
+    }
+}
+
+// Хеш усієї сцени; за кешованими хешами груп — без обходу дерева
+uint64_t sceneHash(const vector<Ref<GraphicObject>>& objects) {
+    uint64_t h = mixHash(0, objects.size()); // ненульовий і для порожньої сцени
+    for (auto& obj : objects) h = mixHash(h, obj->hash());
+    return h;
+}
+
+// Запит вибірки об'єктів:
+//   select circles|rectangles|groups|shapes|all [where умова] [in ID] [within x0 y0 x1 y1]
+// Умова — порівняння поля з числом (<, <=, >, >=, =, !=), and, or, not і дужки.
+// Поля: x, y (світові координати центру кола або кута прямокутника чи групи), id,
+// radius, width, height, area; для груп — count, circles, rectangles, groups
+// (показники нащадків). in — лише нащадки групи з таким ID; within — лише
+// об'єкти, що повністю лежать в області.
+//
+// Запит компілюється в ланцюжок перевірок (тип, область, умова). Порівняння,
+// обов'язкові для кожного збігу (з'єднані and на верхньому рівні), задають межі
+// пошуку: піддерево пропускається, якщо його межі не перетинають область пошуку,
+// менші за шуканий розмір або якщо показники групи кажуть, що потрібних типів у ньому немає.
+class SceneQuery {
+public:
+    struct Match {
+        Ref<GraphicObject> obj;
+        BBox bounds; // у світових координатах
+    };
+private:
+    // Кандидат: об'єкт і світовий зсув його батька
+    struct Subject {
+        const GraphicObject* obj;
+        int ox, oy;
+    };
+    using Field = bool (*)(const Subject&, double&); // false — поле не має сенсу для об'єкта
+    using Predicate = function<bool(const Subject&)>;
+    enum class Op { Less, LessEq, Greater, GreaterEq, Equal, NotEqual };
+
+    struct Node {
+        enum Type { Compare, And, Or, Not } type;
+        string field;
+        Op op = Op::Equal;
+        double value = 0;
+        unique_ptr<Node> left, right;
+        explicit Node(Type type) : type(type) {}
+    };
+
+    struct Token {
+        enum Type { Word, Number, Symbol, End } type;
+        string text;
+        double value = 0;
+    };
+
+    static runtime_error error(const string& what) { return runtime_error("Помилка запиту: " + what); }
+
+    static vector<Token> tokenize(const string& text) {
+        vector<Token> tokens;
+        size_t i = 0;
+        while (i < text.size()) {
+            unsigned char c = (unsigned char)text[i];
+            if (isspace(c)) { ++i; continue; }
+            size_t start = i;
+            bool number = isdigit(c) || ((c == '-' || c == '.') && i + 1 < text.size() && isdigit((unsigned char)text[i + 1]));
+            if (number) {
+                ++i;
+                while (i < text.size() && (isdigit((unsigned char)text[i]) || text[i] == '.')) ++i;
+                Token t{Token::Number, text.substr(start, i - start)};
+                // stod розбирає й префікс ("1.2" з "1.2.3"), тож число має займати весь токен
+                size_t used = 0;
+                try { t.value = stod(t.text, &used); } catch (const exception&) { used = 0; }
+                if (used != t.text.size()) throw error("некоректне число " + t.text);
+                tokens.push_back(t);
+            } else if (isalpha(c) || c == '_') {
+                while (i < text.size() && (isalnum((unsigned char)text[i]) || text[i] == '_')) ++i;
+                string word = text.substr(start, i - start);
+                for (auto& ch : word) ch = (char)tolower((unsigned char)ch);
+                tokens.push_back({Token::Word, word});
+            } else if (strchr("<>=!", c)) {
+                ++i;
+                if (i < text.size() && text[i] == '=') ++i;
+                tokens.push_back({Token::Symbol, text.substr(start, i - start)});
+            } else if (strchr("()*#", c)) {
+                ++i;
+                tokens.push_back({Token::Symbol, string(1, (char)c)});
+            } else {
+                throw error(string("неочікуваний символ '") + (char)c + "'");
+            }
+        }
+        tokens.push_back({Token::End, ""});
+        return tokens;
+    }
+
+    // Розбір рекурсивним спуском; and зв'язує сильніше за or
+    struct Parser {
+        vector<Token> tokens;
+        size_t pos = 0;
+
+        const Token& peek() const { return tokens[pos]; }
+        bool accept(const string& text) {
+            if (peek().type == Token::End || peek().text != text) return false;
+            ++pos;
+            return true;
+        }
+        void expect(const string& text) {
+            if (!accept(text)) throw error("очікувалося '" + text + "'" + near());
+        }
+        string near() const { return peek().type == Token::End ? " в кінці запиту" : " перед '" + peek().text + "'"; }
+        double number() {
+            if (peek().type != Token::Number) throw error("очікувалося число" + near());
+            return tokens[pos++].value;
+        }
+
+        unique_ptr<Node> expression() {
+            auto node = term();
+            while (accept("or")) node = combine(Node::Or, move(node), term());
+            return node;
+        }
+        unique_ptr<Node> term() {
+            auto node = factor();
+            while (accept("and")) node = combine(Node::And, move(node), factor());
+            return node;
+        }
+        unique_ptr<Node> factor() {
+            if (accept("not")) {
+                unique_ptr<Node> node(new Node(Node::Not));
+                node->left = factor();
+                return node;
+            }
+            if (accept("(")) {
+                auto node = expression();
+                expect(")");
+                return node;
+            }
+            if (peek().type != Token::Word) throw error("очікувалося поле" + near());
+            unique_ptr<Node> node(new Node(Node::Compare));
+            node->field = tokens[pos++].text;
+            if (!findField(node->field)) throw error("невідоме поле " + node->field);
+            static const pair<const char*, Op> ops[] = {
+                {"<", Op::Less}, {"<=", Op::LessEq}, {">", Op::Greater}, {">=", Op::GreaterEq},
+                {"=", Op::Equal}, {"==", Op::Equal}, {"!=", Op::NotEqual}};
+            auto it = find_if(begin(ops), end(ops), [&](const pair<const char*, Op>& o) {
+                return peek().type == Token::Symbol && peek().text == o.first;
+            });
+            if (it == end(ops)) throw error("очікувалося порівняння" + near());
+            ++pos;
+            node->op = it->second;
+            node->value = number();
+            return node;
+        }
+        static unique_ptr<Node> combine(Node::Type type, unique_ptr<Node> a, unique_ptr<Node> b) {
+            unique_ptr<Node> node(new Node(type));
+            node->left = move(a);
+            node->right = move(b);
+            return node;
+        }
+    };
+
+    static Field findField(const string& name) {
+        static const pair<const char*, Field> fields[] = {
+            {"x", [](const Subject& s, double& v) { v = s.ox + s.obj->getX(); return true; }},
+            {"y", [](const Subject& s, double& v) { v = s.oy + s.obj->getY(); return true; }},
+            {"id", [](const Subject& s, double& v) { v = s.obj->getId(); return true; }},
+            {"radius", [](const Subject& s, double& v) {
+                auto c = shapeCast<Circle>(s.obj);
+                if (c) v = c->getRadius();
+                return c != nullptr;
+            }},
+            {"width", [](const Subject& s, double& v) {
+                auto r = shapeCast<Rectangle>(s.obj);
+                if (r) v = r->getWidth();
+                return r != nullptr;
+            }},
+            {"height", [](const Subject& s, double& v) {
+                auto r = shapeCast<Rectangle>(s.obj);
+                if (r) v = r->getHeight();
+                return r != nullptr;
+            }},
+            {"area", [](const Subject& s, double& v) { v = s.obj->stats().area(); return true; }},
+            {"count", [](const Subject& s, double& v) {
+                auto g = shapeCast<Group>(s.obj);
+                if (g) v = (double)g->descendantStats().count();
+                return g != nullptr;
+            }},
+            {"circles", [](const Subject& s, double& v) {
+                auto g = shapeCast<Group>(s.obj);
+                if (g) v = (double)g->descendantStats().of(ShapeKind::Circle);
+                return g != nullptr;
+            }},
+            {"rectangles", [](const Subject& s, double& v) {
+                auto g = shapeCast<Group>(s.obj);
+                if (g) v = (double)g->descendantStats().of(ShapeKind::Rectangle);
+                return g != nullptr;
+            }},
+            {"groups", [](const Subject& s, double& v) {
+                auto g = shapeCast<Group>(s.obj);
+                if (g) v = (double)g->descendantStats().of(ShapeKind::Group);
+                return g != nullptr;
+            }},
+        };
+        for (auto& f : fields)
+            if (name == f.first) return f.second;
+        return nullptr;
+    }
+
+    static Predicate compileNode(const Node& node) {
+        switch (node.type) {
+            case Node::And: {
+                auto a = compileNode(*node.left), b = compileNode(*node.right);
+                return [a, b](const Subject& s) { return a(s) && b(s); };
+            }
+            case Node::Or: {
+                auto a = compileNode(*node.left), b = compileNode(*node.right);
+                return [a, b](const Subject& s) { return a(s) || b(s); };
+            }
+            case Node::Not: {
+                auto a = compileNode(*node.left);
+                return [a](const Subject& s) { return !a(s); };
+            }
+            default: break;
+        }
+        Field f = findField(node.field);
+        double v = node.value;
+        switch (node.op) {
+            case Op::Less:      return [f, v](const Subject& s) { double x; return f(s, x) && x < v; };
+            case Op::LessEq:    return [f, v](const Subject& s) { double x; return f(s, x) && x <= v; };
+            case Op::Greater:   return [f, v](const Subject& s) { double x; return f(s, x) && x > v; };
+            case Op::GreaterEq: return [f, v](const Subject& s) { double x; return f(s, x) && x >= v; };
+            case Op::Equal:     return [f, v](const Subject& s) { double x; return f(s, x) && x == v; };
+            default:            return [f, v](const Subject& s) { double x; return f(s, x) && x != v; };
+        }
+    }
+
+    static unsigned bit(ShapeKind kind) { return 1u << (unsigned)kind; }
+
+    // Типи, що можуть задовольнити порівняння, обов'язкове для кожного збігу
+    void narrowKinds(const Node& cmp) {
+        if (cmp.field == "radius") kinds &= bit(ShapeKind::Circle);
+        else if (cmp.field == "width" || cmp.field == "height") kinds &= bit(ShapeKind::Rectangle);
+        else if (cmp.field == "count" || cmp.field == "circles" || cmp.field == "rectangles" || cmp.field == "groups")
+            kinds &= bit(ShapeKind::Group);
+    }
+    // Межі пошуку з такого порівняння (після narrowKinds для всіх)
+    void narrowArea(const Node& cmp) {
+        // Цілочисельні межі поля: lo <= значення <= hi
+        const double lowest = numeric_limits<int>::min(), highest = numeric_limits<int>::max();
+        double lo = lowest, hi = highest;
+        switch (cmp.op) {
+            case Op::Less:      hi = ceil(cmp.value) - 1; break;
+            case Op::LessEq:    hi = floor(cmp.value); break;
+            case Op::Greater:   lo = floor(cmp.value) + 1; break;
+            case Op::GreaterEq: lo = ceil(cmp.value); break;
+            case Op::Equal:     lo = ceil(cmp.value); hi = floor(cmp.value); break;
+            default: return;
+        }
+        if (std::isnan(lo) || std::isnan(hi)) return;
+        // Обидві межі в діапазоні int: звужена область однаково лише надмножина відповідей
+        lo = min(max(lo, lowest), highest);
+        hi = min(max(hi, lowest), highest);
+        if (cmp.field == "radius" || cmp.field == "width" || cmp.field == "height") {
+            // Межі кола — 2r + 1 точок, прямокутника — розмір + 1
+            int extent = (int)min(max(cmp.field == "radius" ? 2 * lo + 1 : lo + 1, lowest), highest);
+            if (cmp.field != "height") minWidth = max(minWidth, extent);
+            if (cmp.field != "width") minHeight = max(minHeight, extent);
+        } else if (cmp.field == "x" || cmp.field == "y") {
+            // Точка прив'язки кола чи прямокутника лежить у його межах, групи — не обов'язково
+            if (kinds & bit(ShapeKind::Group)) return;
+            if (cmp.field == "x") searchArea = searchArea.intersect(BBox((int)lo, searchArea.minY, (int)hi, searchArea.maxY));
+            else searchArea = searchArea.intersect(BBox(searchArea.minX, (int)lo, searchArea.maxX, (int)hi));
+        }
+    }
+    // Порівняння, з'єднані and на верхньому рівні умови
+    static void requiredComparisons(const Node& node, vector<const Node*>& out) {
+        if (node.type == Node::And) {
+            requiredComparisons(*node.left, out);
+            requiredComparisons(*node.right, out);
+        } else if (node.type == Node::Compare) {
+            out.push_back(&node);
+        }
+    }
+
+    unsigned kinds = 0;
+    Predicate where;
+    int inId = 0;          // 0 — уся сцена
+    bool hasWithin = false;
+    BBox within;
+    BBox searchArea{numeric_limits<int>::min(), numeric_limits<int>::min(),
+                    numeric_limits<int>::max(), numeric_limits<int>::max()};
+    int minWidth = 0, minHeight = 0;
+
+    struct Found {
+        const GraphicObject* obj;
+        BBox bounds;
+    };
+
+    void visit(const GraphicObject* obj, int ox, int oy, vector<Found>& out) const {
+        BBox b = obj->bounds().translated(ox, oy);
+        if (!b.intersects(searchArea) || b.width() < minWidth || b.height() < minHeight) return;
+        auto grp = shapeCast<Group>(obj);
+        if ((kinds & bit(obj->getKind())) && (!hasWithin || within.contains(b)) && (!where || where({obj, ox, oy})))
+            out.push_back({obj, b});
+        if (!grp) return;
+        const SubtreeStats& d = grp->descendantStats();
+        bool any = false;
+        for (size_t k = 0; k < d.byKind.size(); ++k)
+            if ((kinds & (1u << k)) && d.byKind[k] > 0) any = true;
+        if (!any) return;
+        for (auto& child : grp->getChildren())
+            visit(child.get(), ox + grp->getX(), oy + grp->getY(), out);
+    }
+
+    // Група з ID id серед children та їхніх нащадків; ox, oy — світовий зсув її батька.
+    // Спуск лише в групи, діапазон ID нащадків яких містить id (він відомий і для
+    // нерозпакованої групи), тож розпаковуються здебільшого лише групи на шляху до неї
+    template <class List>
+    static const Group* findGroup(const List& children, int id, int& ox, int& oy) {
+        for (auto& child : children) {
+            auto grp = shapeCast<Group>(child.get());
+            if (!grp) continue;
+            if (grp->getId() == id) return grp;
+            if (!grp->descendantIdRange().contains(id)) continue;
+            int cx = ox + grp->getX(), cy = oy + grp->getY();
+            if (auto found = findGroup(grp->getChildren(), id, cx, cy)) {
+                ox = cx;
+                oy = cy;
+                return found;
+            }
+        }
+        return nullptr;
+    }
+public:
+    // Поріг кількості коренів пошуку, з якого вибірка йде паралельно
+    static constexpr size_t parallelThreshold = 4096;
+
+    static SceneQuery compile(const string& text) {
+        Parser p{tokenize(text)};
+        SceneQuery q;
+        p.expect("select");
+        static const pair<const char*, unsigned> kindNames[] = {
+            {"circles", bit(ShapeKind::Circle)}, {"rectangles", bit(ShapeKind::Rectangle)},
+            {"groups", bit(ShapeKind::Group)},
+            {"shapes", bit(ShapeKind::Circle) | bit(ShapeKind::Rectangle)},
+            {"all", bit(ShapeKind::Circle) | bit(ShapeKind::Rectangle) | bit(ShapeKind::Group)},
+            {"*", bit(ShapeKind::Circle) | bit(ShapeKind::Rectangle) | bit(ShapeKind::Group)}};
+        for (auto& k : kindNames)
+            if (p.accept(k.first)) { q.kinds = k.second; break; }
+        if (!q.kinds) throw error("очікувався тип об'єктів (circles, rectangles, groups, shapes, all)" + p.near());
+        unique_ptr<Node> condition;
+        while (p.peek().type != Token::End) {
+            if (!condition && p.accept("where")) {
+                condition = p.expression();
+            } else if (!q.inId && p.accept("in")) {
+                p.accept("#");
+                double id = p.number();
+                if (id < 1 || id != floor(id) || id > numeric_limits<int>::max()) throw error("некоректний ID групи");
+                q.inId = (int)id;
+            } else if (!q.hasWithin && p.accept("within")) {
+                double x0 = p.number(), y0 = p.number(), x1 = p.number(), y1 = p.number();
+                q.within = BBox((int)floor(min(x0, x1)), (int)floor(min(y0, y1)), (int)ceil(max(x0, x1)), (int)ceil(max(y0, y1)));
+                q.hasWithin = true;
+            } else {
+                throw error("неочікуване '" + p.peek().text + "'");
+            }
+        }
+        if (condition) {
+            q.where = compileNode(*condition);
+            vector<const Node*> required;
+            requiredComparisons(*condition, required);
+            for (auto cmp : required) q.narrowKinds(*cmp);
+            for (auto cmp : required) q.narrowArea(*cmp);
+        }
+        if (q.hasWithin) q.searchArea = q.searchArea.intersect(q.within);
+        return q;
+    }
+
+    // Покрокове виконання запиту: корені пошуку (об'єкти верхнього рівня або
+    // діти групи in) діляться на порції по chunkSize, step обробляє кілька порцій
+    // між threads потоками (0 — за кількістю ядер). Потоки лише читають сцену й
+    // збирають вказівники, а Ref створюються вже в matches. Запит має жити довше
+    // за виконання; сцену між кроками змінювати не можна.
+    class Execution {
+        const SceneQuery& query;
+        vector<Ref<GraphicObject>> top; // тримає корені живими між кроками
+        const Ref<GraphicObject>* roots;
+        size_t count;
+        int ox = 0, oy = 0;
+        unsigned threads;
+        vector<vector<Found>> parts;
+        size_t nextChunk = 0;
+    public:
+        static constexpr size_t chunkSize = 256;
+
+        Execution(const SceneQuery& query, const vector<Ref<GraphicObject>>& objects, unsigned threads = 0)
+            : query(query), top(objects), roots(top.data()), count(top.size()), threads(threads) {
+            if (query.inId) {
+                const Group* scope = findGroup(top, query.inId, ox, oy);
+                if (!scope) throw runtime_error("Групу з ID " + to_string(query.inId) + " не знайдено");
+                ox += scope->getX();
+                oy += scope->getY();
+                roots = scope->getChildren().begin();
+                count = scope->getChildren().size();
+            }
+            if (query.searchArea.empty()) count = 0;
+            if (this->threads == 0) this->threads = max(1u, thread::hardware_concurrency());
+            if (count < parallelThreshold) this->threads = 1;
+            parts.resize((count + chunkSize - 1) / chunkSize);
+        }
+
+        // Обробляє до maxChunks порцій; false — усі корені переглянуто
+        bool step(size_t maxChunks = SIZE_MAX) {
+            size_t end = nextChunk + min(maxChunks, parts.size() - nextChunk);
+            atomic<size_t> next(nextChunk);
+            mutex errorMutex;
+            exception_ptr failure;
+            auto worker = [&]() {
+                try {
+                    for (size_t c; (c = next++) < end; )
+                        for (size_t i = c * chunkSize; i < min(count, (c + 1) * chunkSize); ++i)
+                            query.visit(roots[i].get(), ox, oy, parts[c]);
+                } catch (...) {
+                    // Наприклад, не вдалося підвантажити групу з файлу
+                    lock_guard<mutex> lock(errorMutex);
+                    if (!failure) failure = current_exception();
+                    next = end;
+                }
+            };
+            vector<thread> pool;
+            for (size_t i = 1; i < min<size_t>(threads, end - nextChunk); ++i) pool.emplace_back(worker);
+            worker();
+            for (auto& th : pool) th.join();
+            if (failure) rethrow_exception(failure);
+            nextChunk = end;
+            return nextChunk < parts.size();
+        }
+        double progress() const { return parts.empty() ? 1.0 : (double)nextChunk / parts.size(); }
+
+        // Результати у порядку малювання
+        vector<Match> matches() const {
+            vector<Match> out;
+            for (auto& part : parts)
+                for (auto& f : part)
+                    out.push_back({Ref<GraphicObject>(const_cast<GraphicObject*>(f.obj)), f.bounds});
+            return out;
+        }
+    };
+
+    // Виконує запит за один раз; результати — у порядку малювання
+    vector<Match> run(const vector<Ref<GraphicObject>>& objects, unsigned threads = 0) const {
+        Execution e(*this, objects, threads);
+        e.step();
+        return e.matches();
+    }
+};
+
+// Відмінність між двома версіями сцени
+struct SceneChange {
+    enum Kind { Added, Removed, Changed } kind;
+    vector<size_t> path; // індекси від верхнього рівня (для Removed — у старій версії)
+    Ref<GraphicObject> before, after;
+};
+
+void diffNodes(const Ref<GraphicObject>& a, const Ref<GraphicObject>& b, vector<size_t>& path,
+               vector<SceneChange>& out, size_t& visited);
+
+// Порівняння списків дітей: піддерева з однаковим хешем пропускаються без
+// обходу; спільні початок і кінець вирівнюються за хешами, решта — попарно
+void diffLists(const Ref<GraphicObject>* a, size_t na, const Ref<GraphicObject>* b, size_t nb,
+               vector<size_t>& path, vector<SceneChange>& out, size_t& visited) {
+    size_t pre = 0, suf = 0;
+    while (pre < na && pre < nb && a[pre]->hash() == b[pre]->hash()) ++pre;
+    while (suf < na - pre && suf < nb - pre && a[na - 1 - suf]->hash() == b[nb - 1 - suf]->hash()) ++suf;
+    visited += pre + suf;
+    size_t ma = na - pre - suf, mb = nb - pre - suf;
+    for (size_t i = 0; i < max(ma, mb); ++i) {
+        path.push_back(pre + i);
+        if (i < ma && i < mb) diffNodes(a[pre + i], b[pre + i], path, out, visited);
+        else if (i < ma) out.push_back({SceneChange::Removed, path, a[pre + i], nullptr});
+        else out.push_back({SceneChange::Added, path, nullptr, b[pre + i]});
+        path.pop_back();
+    }
+}
+
+void diffNodes(const Ref<GraphicObject>& a, const Ref<GraphicObject>& b, vector<size_t>& path,
+               vector<SceneChange>& out, size_t& visited) {
+    ++visited;
+    if (a->hash() == b->hash()) return;
+    auto ga = shapeCast<Group>(a.get()), gb = shapeCast<Group>(b.get());
+    if (!ga || !gb) {
+        out.push_back({SceneChange::Changed, path, a, b});
+        return;
+    }
+    // Група: власна позиція окремо, діти — рекурсивно
+    if (ga->getX() != gb->getX() || ga->getY() != gb->getY())
+        out.push_back({SceneChange::Changed, path, a, b});
+    auto& ca = ga->getChildren();
+    auto& cb = gb->getChildren();
+    diffLists(ca.begin(), ca.size(), cb.begin(), cb.size(), path, out, visited);
+}
+
+// Відмінності між версіями сцени; visited (якщо задано) — скільки вузлів довелося відвідати
+vector<SceneChange> diffScenes(const vector<Ref<GraphicObject>>& before, const vector<Ref<GraphicObject>>& after,
+                               size_t* visited = nullptr) {
+    vector<SceneChange> out;
+    vector<size_t> path;
+    size_t count = 0;
+    diffLists(before.data(), before.size(), after.data(), after.size(), path, out, count);
+    if (visited) *visited = count;
+    return out;
+}
+
+// Дельта сцени для синхронізації копій: операції над об'єктами за стабільними ID.
+// Об'єкт задається шляхом ID від верхнього рівня, тож застосування торкається
+// лише груп на цьому шляху. Формат:
+//   "LB5D", хеш базової й цільової версії (по 8 байт, 0 — не перевіряти),
+//   кількість операцій, операції: тег, шлях (довжина, ID...), далі
+//   Add: позиція серед дітей батька (шлях — до батька, порожній — верхній рівень), запис;
+//   Remove: позиція серед дітей батька; Move: dx, dy; Replace: позиція, запис
+//   (записи — SceneCodec із довжиною).
+class SceneDelta {
+    static constexpr char magic[4] = {'L', 'B', '5', 'D'};
+    ByteWriter ops;
+    size_t count = 0;
+
+    void begin(uint64_t op, const vector<int>& path) {
+        ops.varint(op);
+        ops.varint(path.size());
+        for (int id : path) ops.varint((uint64_t)id);
+        ++count;
+    }
+    // Однакові тип і розміри (позиція не враховується); для груп — лише тип
+    static bool sameShape(const GraphicObject& a, const GraphicObject& b) {
+        if (a.getKind() != b.getKind()) return false;
+        if (auto c = shapeCast<Circle>(&a)) return c->getRadius() == static_cast<const Circle&>(b).getRadius();
+        if (auto r = shapeCast<Rectangle>(&a)) {
+            auto& o = static_cast<const Rectangle&>(b);
+            return r->getWidth() == o.getWidth() && r->getHeight() == o.getHeight();
+        }
+        return true;
+    }
+    void record(const GraphicObject& obj) {
+        ByteWriter w;
+        int prevId = 0;
+        SceneCodec::encode(w, obj, prevId);
+        ops.varint(w.size());
+        ops.raw(w.data().data(), w.size());
+    }
+public:
+    enum Op { Add = 1, Remove, Move, Replace };
+    struct Operation {
+        Op op;
+        vector<int> path;
+        // Add: позиція вставки серед дітей батька; Remove, Replace: позиція
+        // об'єкта під час запису (підказка, що збігається, знімає пошук)
+        size_t index = 0;
+        int dx = 0, dy = 0;
+        Ref<GraphicObject> obj; // Add, Replace: новий об'єкт з ID із дельти
+    };
+    uint64_t baseHash = 0, targetHash = 0;
+
+    void add(const vector<int>& parentPath, size_t index, const GraphicObject& obj) {
+        begin(Add, parentPath);
+        ops.varint(index);
+        record(obj);
+    }
+    void remove(const vector<int>& path, size_t index) {
+        begin(Remove, path);
+        ops.varint(index);
+    }
+    void move(const vector<int>& path, int dx, int dy) {
+        begin(Move, path);
+        ops.svarint(dx);
+        ops.svarint(dy);
+    }
+    void replace(const vector<int>& path, size_t index, const GraphicObject& obj) {
+        begin(Replace, path);
+        ops.varint(index);
+        record(obj);
+    }
+    size_t size() const { return count; }
+
+    vector<uint8_t> encode() const {
+        vector<uint8_t> out(magic, magic + 4);
+        for (uint64_t h : {baseHash, targetHash})
+            for (int i = 0; i < 8; ++i) out.push_back((uint8_t)(h >> (8 * i)));
+        ByteWriter w;
+        w.varint(count);
+        out.insert(out.end(), w.data().begin(), w.data().end());
+        out.insert(out.end(), ops.data().begin(), ops.data().end());
+        return out;
+    }
+    static SceneDelta decode(const vector<uint8_t>& bytes) {
+        if (bytes.size() < 20 || !equal(magic, magic + 4, bytes.begin())) throw runtime_error("Файл не є дельтою LB5");
+        SceneDelta d;
+        for (int i = 0; i < 8; ++i) d.baseHash |= (uint64_t)bytes[4 + i] << (8 * i);
+        for (int i = 0; i < 8; ++i) d.targetHash |= (uint64_t)bytes[12 + i] << (8 * i);
+        ByteReader r(bytes.data() + 20, bytes.size() - 20);
+        d.count = r.varint();
+        d.ops.raw(r.position(), r.remaining());
+        return d;
+    }
+
+    // Розбирає операції по черзі; записи декодуються повністю, ID зберігаються
+    void forEach(const function<void(const Operation&)>& visit) const {
+        ByteReader r(ops.data());
+        for (size_t i = 0; i < count; ++i) {
+            Operation o;
+            o.op = (Op)r.varint();
+            size_t depth = r.varint();
+            if (depth > r.remaining()) throw runtime_error("Пошкоджені дані: шлях операції");
+            for (size_t k = 0; k < depth; ++k) o.path.push_back((int)r.varint());
+            if (o.op == Add || o.op == Remove || o.op == Replace) o.index = r.varint();
+            if (o.op == Move) {
+                o.dx = (int)r.svarint();
+                o.dy = (int)r.svarint();
+            }
+            if (o.op == Add || o.op == Replace) {
+                size_t len = r.varint();
+                const uint8_t* start = r.position();
+                r.skip(len);
+                ByteReader rec(start, len);
+                int prevId = 0;
+                o.obj = SceneCodec::decodeTree(rec, prevId);
+            }
+            if (o.op < Add || o.op > Replace || (o.op != Add && o.path.empty()))
+                throw runtime_error("Пошкоджені дані: невідома операція");
+            visit(o);
+        }
+    }
+
+    // Дельта між двома версіями з однаковими ID (наприклад, збереженою й поточною).
+    // Об'єкти, що змінили батька, порядок серед сусідів або тип, переносяться
+    // як Remove + Add; решта — Move/Replace. Обходить обидві версії повністю.
+    static SceneDelta between(const vector<Ref<GraphicObject>>& before, const vector<Ref<GraphicObject>>& after) {
+        struct Place {
+            const GraphicObject* obj;
+            int parent; // 0 — верхній рівень
+            size_t index;
+        };
+        using Index = unordered_map<int, Place>;
+        using Kids = unordered_map<int, vector<int>>;
+        auto build = [](const vector<Ref<GraphicObject>>& objects, Index& index, Kids& kids) {
+            function<void(const GraphicObject&, int, size_t)> walk = [&](const GraphicObject& obj, int parent, size_t i) {
+                index[obj.getId()] = {&obj, parent, i};
+                kids[parent].push_back(obj.getId());
+                if (auto grp = shapeCast<Group>(&obj)) {
+                    auto& children = grp->getChildren();
+                    for (size_t k = 0; k < children.size(); ++k) walk(*children[k], obj.getId(), k);
+                }
+            };
+            for (size_t i = 0; i < objects.size(); ++i) walk(*objects[i], 0, i);
+        };
+        Index a, b;
+        Kids kidsA, kidsB;
+        build(before, a, kidsA);
+        build(after, b, kidsB);
+
+        // Перенесені: інший батько або тип, або змінився порядок серед сусідів
+        unordered_set<int> moved;
+        for (auto& e : b) {
+            auto it = a.find(e.first);
+            if (it != a.end() && (it->second.parent != e.second.parent || it->second.obj->getKind() != e.second.obj->getKind()))
+                moved.insert(e.first);
+        }
+        for (auto& k : kidsB) {
+            auto survivors = [&](const vector<int>& ids, const Index& other) {
+                vector<int> out;
+                for (int id : ids) {
+                    auto it = other.find(id);
+                    if (it != other.end() && it->second.parent == k.first && !moved.count(id)) out.push_back(id);
+                }
+                return out;
+            };
+            vector<int> sb = survivors(k.second, a);
+            if (survivors(kidsA[k.first], b) != sb) moved.insert(sb.begin(), sb.end());
+        }
+        auto gone = [&](int id) { return !b.count(id) || moved.count(id); };
+        auto fresh = [&](int id) { return !a.count(id) || moved.count(id); };
+        auto path = [](const Index& index, int id) {
+            vector<int> p;
+            for (; id != 0; id = index.at(id).parent) p.push_back(id);
+            reverse(p.begin(), p.end());
+            return p;
+        };
+        // Чи є серед предків вузол, що видаляється (додається) цілим піддеревом
+        auto insideGone = [&](int id) {
+            for (int p = a.at(id).parent; p != 0; p = a.at(p).parent)
+                if (gone(p)) return true;
+            return false;
+        };
+        auto insideFresh = [&](int id) {
+            for (int p = b.at(id).parent; p != 0; p = b.at(p).parent)
+                if (fresh(p)) return true;
+            return false;
+        };
+
+        SceneDelta d;
+        d.baseHash = sceneHash(before);
+        d.targetHash = sceneHash(after);
+        // Видалення за спаданням позиції: попередні не зсувають наступних, тож
+        // записані позиції лишаються точними
+        vector<int> removed;
+        for (auto& e : a)
+            if (gone(e.first) && !insideGone(e.first)) removed.push_back(e.first);
+        sort(removed.begin(), removed.end(), [&](int x, int y) { return a.at(x).index > a.at(y).index; });
+        for (int id : removed)
+            d.remove(path(a, id), a.at(id).index);
+        // Заміни виконуються після видалень і до додавань: позиція серед сусідів —
+        // серед тих, що лишилися (порядок їх однаковий в обох версіях)
+        unordered_map<int, size_t> kept;
+        for (auto& k : kidsB) {
+            size_t pos = 0;
+            for (int id : k.second)
+                if (!fresh(id)) kept[id] = pos++;
+        }
+        for (auto& e : b) {
+            if (fresh(e.first) || insideFresh(e.first)) continue;
+            const GraphicObject& was = *a.at(e.first).obj;
+            const GraphicObject& now = *e.second.obj;
+            if (!sameShape(was, now))
+                d.replace(path(b, e.first), kept.at(e.first), now);
+            else if (now.getX() != was.getX() || now.getY() != was.getY())
+                d.move(path(b, e.first), now.getX() - was.getX(), now.getY() - was.getY());
+        }
+        // Додавання — від верхніх рівнів до нижніх, серед сусідів за зростанням позиції
+        vector<pair<vector<int>, int>> adds;
+        for (auto& e : b)
+            if (fresh(e.first) && !insideFresh(e.first))
+                adds.push_back({path(b, e.first), e.first});
+        sort(adds.begin(), adds.end(), [&](const pair<vector<int>, int>& x, const pair<vector<int>, int>& y) {
+            if (x.first.size() != y.first.size()) return x.first.size() < y.first.size();
+            return b.at(x.second).index < b.at(y.second).index;
+        });
+        for (auto& add : adds) {
+            vector<int> parentPath(add.first.begin(), add.first.end() - 1);
+            d.add(parentPath, b.at(add.second).index, *b.at(add.second).obj);
+        }
+        return d;
+    }
+};
+
+// Реплікована сцена для спільного редагування (CRDT). Кожна копія змінює
+// свій стан одразу, а операції інших копій зливає в будь-якому порядку —
+// результат однаковий. Порядок малювання у кожному контейнері (верхній
+// рівень або група) — послідовність RGA: вставка "після елемента", одночасні
+// вставки в одне місце впорядковуються за ID. Позиція — регістр LWW: перемагає
+// зміна з більшою міткою; вона відносна до контейнера, як і в Group, тож
+// переміщення групи зсуває й усіх її нащадків. Видалення лишає надгробок.
+// ID елементів і мітки — (лампортів годинник << 32) | номер копії.
+class ReplicatedScene {
+public:
+    enum OpType : uint8_t { Insert, Move, Remove };
+    struct Op {
+        OpType type;
+        uint64_t id;     // Insert: ID нового елемента; інакше — мітка операції
+        uint64_t target; // Insert: контейнер (0 — верхній рівень); інакше — елемент
+        uint64_t after;  // Insert: попередній елемент у контейнері (0 — на початок)
+        ShapeKind kind;
+        int x, y, a, b;  // позиція; радіус або ширина й висота
+    };
+private:
+    struct Node {
+        uint64_t parent = 0, next = 0, firstChild = 0;
+        uint64_t posStamp = 0;
+        ShapeKind kind = ShapeKind::Circle;
+        int x = 0, y = 0, a = 0, b = 0;
+        bool removed = false;
+    };
+    uint32_t replica;
+    uint32_t clock = 0;
+    uint64_t rootFirst = 0;
+    unordered_map<uint64_t, Node> nodes;
+    vector<uint64_t> ids;                      // усі вставлені елементи
+    vector<Op> log;                            // застосовані операції в причинному порядку
+    unordered_map<uint32_t, uint32_t> seen;    // остання застосована мітка від кожної копії
+    unordered_map<uint32_t, size_t> cursor;    // скільки журналу кожної копії вже злито
+
+    static uint32_t clockOf(uint64_t stamp) { return (uint32_t)(stamp >> 32); }
+    static uint32_t replicaOf(uint64_t stamp) { return (uint32_t)stamp; }
+    uint64_t stamp() { return ((uint64_t)++clock << 32) | replica; }
+    uint64_t& firstOf(uint64_t container) { return container ? nodes.at(container).firstChild : rootFirst; }
+
+    void apply(const Op& op) {
+        clock = max(clock, clockOf(op.id));
+        seen[replicaOf(op.id)] = clockOf(op.id);
+        log.push_back(op);
+        if (op.type == Insert) {
+            Node n;
+            n.parent = op.target;
+            n.kind = op.kind;
+            n.x = op.x; n.y = op.y; n.a = op.a; n.b = op.b;
+            n.posStamp = op.id;
+            // Від попереднього елемента пропускаємо новіші вставки в те саме місце
+            uint64_t* link = op.after ? &nodes.at(op.after).next : &firstOf(op.target);
+            while (*link > op.id) link = &nodes.at(*link).next;
+            n.next = *link;
+            nodes[op.id] = n;
+            *link = op.id;
+            ids.push_back(op.id);
+        } else if (op.type == Move) {
+            Node& n = nodes.at(op.target);
+            if (op.id > n.posStamp) {
+                n.posStamp = op.id;
+                n.x = op.x;
+                n.y = op.y;
+            }
+        } else {
+            nodes.at(op.target).removed = true;
+        }
+    }
+    bool isNew(const Op& op) const {
+        auto it = seen.find(replicaOf(op.id));
+        return it == seen.end() || clockOf(op.id) > it->second;
+    }
+public:
+    explicit ReplicatedScene(uint32_t replica) : replica(replica) {}
+    uint32_t getReplica() const { return replica; }
+
+    uint64_t insert(uint64_t container, uint64_t after, ShapeKind kind, int x, int y, int a = 0, int b = 0) {
+        Op op{Insert, stamp(), container, after, kind, x, y, a, b};
+        apply(op);
+        return op.id;
+    }
+    // Вставляє об'єкт разом з усім піддеревом; elements — куди записати
+    // відповідність ID об'єктів створеним елементам
+    uint64_t insert(uint64_t container, uint64_t after, const GraphicObject& obj,
+                    unordered_map<int, uint64_t>* elements = nullptr) {
+        int a = 0, b = 0;
+        if (auto c = shapeCast<Circle>(&obj)) a = c->getRadius();
+        if (auto r = shapeCast<Rectangle>(&obj)) { a = r->getWidth(); b = r->getHeight(); }
+        uint64_t elem = insert(container, after, obj.getKind(), obj.getX(), obj.getY(), a, b);
+        if (elements) (*elements)[obj.getId()] = elem;
+        if (auto grp = shapeCast<Group>(&obj)) {
+            uint64_t prev = 0;
+            for (auto& child : grp->getChildren()) prev = insert(elem, prev, *child, elements);
+        }
+        return elem;
+    }
+    void move(uint64_t elem, int x, int y) { apply({Move, stamp(), elem, 0, ShapeKind::Circle, x, y, 0, 0}); }
+    void remove(uint64_t elem) { apply({Remove, stamp(), elem, 0, ShapeKind::Circle, 0, 0, 0, 0}); }
+
+    // Зливає операції копії peer, яких тут ще немає; повертає їх кількість.
+    // Журнал peer причинно впорядкований, тож залежності кожної операції вже застосовані.
+    size_t merge(const ReplicatedScene& peer) {
+        size_t& from = cursor[peer.replica];
+        size_t merged = 0;
+        for (; from < peer.log.size(); ++from) {
+            const Op& op = peer.log[from];
+            if (!isNew(op)) continue;
+            apply(op);
+            ++merged;
+        }
+        return merged;
+    }
+
+    const vector<uint64_t>& elements() const { return ids; }
+    bool isRemoved(uint64_t elem) const { return nodes.at(elem).removed; }
+    uint64_t containerOf(uint64_t elem) const { return nodes.at(elem).parent; }
+    ShapeKind kindOf(uint64_t elem) const { return nodes.at(elem).kind; }
+    size_t logSize() const { return log.size(); }
+    // Живі елементи контейнера в порядку малювання
+    vector<uint64_t> contents(uint64_t container) const {
+        vector<uint64_t> out;
+        for (uint64_t c = container ? nodes.at(container).firstChild : rootFirst; c; c = nodes.at(c).next)
+            if (!nodes.at(c).removed) out.push_back(c);
+        return out;
+    }
+
+    // Поточний вигляд сцени звичайними об'єктами; elements — куди записати
+    // відповідність ID створених об'єктів елементам
+    vector<Ref<GraphicObject>> materialize(unordered_map<int, uint64_t>* elements = nullptr) const {
+        function<Ref<GraphicObject>(uint64_t)> build = [&](uint64_t elem) -> Ref<GraphicObject> {
+            const Node& n = nodes.at(elem);
+            Ref<GraphicObject> obj;
+            if (n.kind == ShapeKind::Circle) obj = makeRef<Circle>(n.x, n.y, n.a);
+            else if (n.kind == ShapeKind::Rectangle) obj = makeRef<Rectangle>(n.x, n.y, n.a, n.b);
+            else {
+                auto grp = makeRef<Group>(n.x, n.y);
+                for (uint64_t c : contents(elem)) grp->add(build(c));
+                obj = grp;
+            }
+            if (elements) (*elements)[obj->getId()] = elem;
+            return obj;
+        };
+        vector<Ref<GraphicObject>> out;
+        for (uint64_t c : contents(0)) out.push_back(build(c));
+        return out;
+    }
+};
+
+// Альтернативне представлення сцени значеннями: закритий набір фігур у
+// std::variant, алгоритми диспетчеризуються std::visit під час компіляції,
+// без vtable та лічильників посилань. Клонування — звичайне копіювання.
+struct VCircle { int x, y, radius; };
+struct VRectangle { int x, y, width, height; };
+struct VNode;
+struct VGroup {
+    int x, y;
+    vector<VNode> children;
+    BBox childBounds; // обчислюється при побудові
+};
+struct VNode {
+    variant<VCircle, VRectangle, VGroup> shape;
+};
+
+template <class... Fs> struct Overloaded : Fs... { using Fs::operator()...; };
+template <class... Fs> Overloaded(Fs...) -> Overloaded<Fs...>;
+
+BBox bounds(const VNode& node) {
+    return visit(Overloaded{
+        [](const VCircle& c) { return BBox(c.x - c.radius, c.y - c.radius, c.x + c.radius, c.y + c.radius); },
+        [](const VRectangle& r) { return BBox(r.x, r.y, r.x + r.width, r.y + r.height); },
+        [](const VGroup& g) { return g.childBounds.translated(g.x, g.y); },
+    }, node.shape);
+}
+
+bool containsPoint(const VNode& node, int px, int py) {
+    return visit(Overloaded{
+        [&](const VCircle& c) {
+            int64_t dx = (int64_t)px - c.x, dy = (int64_t)py - c.y;
+            return dx*dx + dy*dy <= (int64_t)c.radius*c.radius;
+        },
+        [&](const VRectangle& r) { return px >= r.x && px <= r.x + r.width && py >= r.y && py <= r.y + r.height; },
+        [&](const VGroup& g) {
+            if (!g.childBounds.contains(px - g.x, py - g.y)) return false;
+            for (auto it = g.children.rbegin(); it != g.children.rend(); ++it)
+                if (containsPoint(*it, px - g.x, py - g.y)) return true;
+            return false;
+        },
+    }, node.shape);
+}
+
+void draw(const VNode& node, ostream& os, int indent = 0) {
+    visit(Overloaded{
+        [&](const VCircle& c) { os << string(indent, '+') << "Circle (" << c.x << ", " << c.y << ") R=" << c.radius << "\n"; },
+        [&](const VRectangle& r) { os << string(indent, '+') << "Rectangle (" << r.x << ", " << r.y << ") " << r.width << "*" << r.height << "\n"; },
+        [&](const VGroup& g) {
+            os << string(indent, '+') << "Group (" << g.x << ", " << g.y << ")\n";
+            for (auto& child : g.children) draw(child, os, indent + 1);
+        },
+    }, node.shape);
+}
+
+// Найглибший вузол у точці, як Group::findDeepest; nullptr, якщо точка поза вузлом
+const VNode* findDeepest(const VNode& node, int px, int py) {
+    if (!containsPoint(node, px, py)) return nullptr;
+    auto grp = get_if<VGroup>(&node.shape);
+    if (!grp) return &node;
+    for (auto it = grp->children.rbegin(); it != grp->children.rend(); ++it)
+        if (auto found = findDeepest(*it, px - grp->x, py - grp->y)) return found;
+    return &node;
+}
+
+VNode toVariant(const GraphicObject& obj) {
+    if (auto c = shapeCast<Circle>(&obj))
+        return VNode{VCircle{c->getX(), c->getY(), c->getRadius()}};
+    if (auto r = shapeCast<Rectangle>(&obj))
+        return VNode{VRectangle{r->getX(), r->getY(), r->getWidth(), r->getHeight()}};
+    auto& g = static_cast<const Group&>(obj);
+    VGroup grp{g.getX(), g.getY(), {}, BBox()};
+    grp.children.reserve(g.getChildren().size());
+    for (auto& child : g.getChildren()) {
+        grp.children.push_back(toVariant(*child));
+        grp.childBounds.expand(bounds(grp.children.back()));
+    }
+    return VNode{move(grp)};
+}
+
+struct VScene {
+    vector<VNode> objects;
+
+    static VScene from(const vector<Ref<GraphicObject>>& objs) {
+        VScene scene;
+        scene.objects.reserve(objs.size());
+        for (auto& obj : objs) scene.objects.push_back(toVariant(*obj));
+        return scene;
+    }
+    const VNode* findElementAt(int x, int y) const {
+        for (auto it = objects.rbegin(); it != objects.rend(); ++it)
+            if (auto found = findDeepest(*it, x, y)) return found;
+        return nullptr;
+    }
+};
+
+// Вузол плоскої статичної сцени; вузли лежать у прямому порядку обходу,
+// тож нащадки групи займають індекси [index + 1, end)
+struct FlatNode {
+    enum Kind : uint8_t { CircleNode, RectangleNode, GroupNode };
+    Kind kind = CircleNode;
+    int x = 0, y = 0;   // координати в батьківській групі
+    int a = 0, b = 0;   // радіус або ширина й висота
+    int wx = 0, wy = 0; // світові координати
+    int parent = -1;
+    int end = 0;
+
+    constexpr bool containsPoint(int px, int py) const {
+        if (kind == CircleNode) {
+            int64_t dx = (int64_t)px - wx, dy = (int64_t)py - wy;
+            return dx*dx + dy*dy <= (int64_t)a*a;
+        }
+        return kind == RectangleNode && px >= wx && px <= wx + a && py >= wy && py <= wy + b;
+    }
+};
+
+// Сцена, що будується під час компіляції і вбудовується в бінарний файл:
+//   constexpr auto scene = StaticScene<3>().group(2, 2).circle(1, 5, 2).end().rectangle(5, 7, 5, 6).build();
+// У constexpr-ініціалізаторі зайвий end(), переповнення ємності N і незакрита
+// група (її перевіряє завершальний build()) дають помилку компіляції.
+template <size_t N>
+class StaticScene {
+    FlatNode nodes[N] = {};
+    int openGroups[N + 1] = {};
+    int count = 0, depth = 0;
+
+    constexpr StaticScene push(FlatNode node) const {
+        if (count == (int)N) throw length_error("StaticScene: замала ємність");
+        StaticScene s = *this;
+        node.parent = depth ? openGroups[depth - 1] : -1;
+        if (node.parent >= 0) {
+            node.wx = node.x + nodes[node.parent].wx;
+            node.wy = node.y + nodes[node.parent].wy;
+        } else {
+            node.wx = node.x;
+            node.wy = node.y;
+        }
+        node.end = count + 1;
+        s.nodes[s.count++] = node;
+        return s;
+    }
+public:
+    constexpr StaticScene circle(int x, int y, int r) const {
+        FlatNode n;
+        n.kind = FlatNode::CircleNode; n.x = x; n.y = y; n.a = r;
+        return push(n);
+    }
+    constexpr StaticScene rectangle(int x, int y, int w, int h) const {
+        FlatNode n;
+        n.kind = FlatNode::RectangleNode; n.x = x; n.y = y; n.a = w; n.b = h;
+        return push(n);
+    }
+    // Відкриває групу: наступні вузли до end() стають її дітьми
+    constexpr StaticScene group(int x, int y) const {
+        FlatNode n;
+        n.kind = FlatNode::GroupNode; n.x = x; n.y = y;
+        StaticScene s = push(n);
+        s.openGroups[s.depth++] = s.count - 1;
+        return s;
+    }
+    constexpr StaticScene end() const {
+        if (depth == 0) throw logic_error("StaticScene: end() без group()");
+        StaticScene s = *this;
+        s.nodes[s.openGroups[--s.depth]].end = s.count;
+        return s;
+    }
+
+    // Завершує опис сцени: усі групи мають бути закриті
+    constexpr StaticScene build() const {
+        if (depth != 0) throw logic_error("StaticScene: незакрита група");
+        return *this;
+    }
+
+    constexpr int size() const { return count; }
+    constexpr const FlatNode& operator[](int i) const { return nodes[i]; }
+
+    // Найглибший верхній об'єкт: останній у порядку малювання листок, що містить точку
+    constexpr const FlatNode* findElementAt(int x, int y) const {
+        for (int i = count - 1; i >= 0; --i)
+            if (nodes[i].containsPoint(x, y)) return &nodes[i];
+        return nullptr;
+    }
+
+    // Звичайні об'єкти редактора верхнього рівня (для завантаження шаблону)
+    vector<Ref<GraphicObject>> instantiate() const {
+        if (depth != 0) throw logic_error("StaticScene: незакрита група");
+        vector<Ref<GraphicObject>> made(count), roots;
+        for (int i = 0; i < count; ++i) {
+            const FlatNode& n = nodes[i];
+            if (n.kind == FlatNode::CircleNode) made[i] = makeRef<Circle>(n.x, n.y, n.a);
+            else if (n.kind == FlatNode::RectangleNode) made[i] = makeRef<Rectangle>(n.x, n.y, n.a, n.b);
+            else made[i] = makeRef<Group>(n.x, n.y);
+            if (n.parent < 0) roots.push_back(made[i]);
+            else staticRefCast<Group>(made[n.parent])->add(made[i]);
+        }
+        return roots;
+    }
+};
+
+// Початкова сцена редактора
+constexpr auto startScene = StaticScene<7>()
+    .circle(10, 10, 5)
+    .group(2, 2)
+        .rectangle(3, 4, 2, 3)
+        .circle(1, 5, 2)
+        .group(4, 6)
+            .circle(0, 1, 3)
+        .end()
+    .end()
+    .rectangle(5, 7, 5, 6)
+    .build();
+static_assert(startScene.findElementAt(10, 10)->kind == FlatNode::RectangleNode, "прямокутник r1 зверху");
+static_assert(startScene.findElementAt(3, 9)->wy == 9, "коло з group2 перекриває коло group1");
+
+// Подія зміни сцени
+struct SceneEvent {
+    enum Kind : unsigned {
+        Added = 1, Removed = 2, Moved = 4,
+        Replaced = 8, // об'єкт замінено новим з тим самим ID (або вилучено й повернуто)
+        Reset = 16,   // сцену замінено цілком (id = 0)
+        All = 31
+    };
+    Kind kind;
+    int id;     // змінений об'єкт
+    int rootId; // його предок верхнього рівня (або він сам)
+    BBox dirty; // змінена область у світових координатах
+};
+
+// Шина подій сцени (Observer). Події накопичуються, доки триває пакет (одна
+// операція редактора), потім події одного об'єкта зливаються в одну, а кожен
+// підписник отримує лише ті, що пройшли його фільтр, разом із їхньою сумарною областю.
+class SceneEventBus {
+public:
+    using Handler = function<void(const vector<SceneEvent>& batch, const BBox& dirty)>;
+
+    // Пакет на час існування об'єкта; вкладені пакети надсилають разом із зовнішнім
+    class Batch {
+        SceneEventBus& bus;
+    public:
+        explicit Batch(SceneEventBus& bus) : bus(bus) { ++bus.depth; }
+        ~Batch() { if (--bus.depth == 0) bus.flush(); }
+        Batch(const Batch&) = delete;
+        Batch& operator=(const Batch&) = delete;
+    };
+private:
+    struct Subscriber {
+        int token;
+        unsigned kinds;
+        BBox region; // порожня — уся сцена
+        Handler handler;
+    };
+    vector<Subscriber> subscribers;
+    vector<SceneEvent> pending;
+    int depth = 0;
+    int nextToken = 1;
+    size_t published = 0, delivered = 0;
+
+    // Підсумок двох послідовних подій одного об'єкта; 0 — змін немає
+    static unsigned combine(unsigned first, unsigned then) {
+        if (first == 0) return then;
+        if (first == SceneEvent::Reset) return first;
+        if (then == SceneEvent::Removed) return first == SceneEvent::Added ? 0 : then;
+        if (first == SceneEvent::Added) return first;
+        if (first == SceneEvent::Removed || then == SceneEvent::Added) return SceneEvent::Replaced;
+        return first == SceneEvent::Replaced ? first : then;
+    }
+public:
+    // kinds — маска SceneEvent::Kind; повертає ключ для unsubscribe
+    int subscribe(unsigned kinds, Handler handler, const BBox& region = BBox()) {
+        subscribers.push_back({nextToken, kinds, region, move(handler)});
+        return nextToken++;
+    }
+    void unsubscribe(int token) {
+        subscribers.erase(remove_if(subscribers.begin(), subscribers.end(),
+            [token](const Subscriber& s) { return s.token == token; }), subscribers.end());
+    }
+
+    void publish(const SceneEvent& e) {
+        pending.push_back(e);
+        ++published;
+        if (depth == 0) flush();
+    }
+
+    void flush() {
+        if (pending.empty()) return;
+        vector<SceneEvent> merged;
+        vector<unsigned> kinds;
+        unordered_map<int, size_t> slot;
+        for (auto& e : pending) {
+            auto it = slot.find(e.id);
+            if (it == slot.end()) {
+                slot.emplace(e.id, merged.size());
+                merged.push_back(e);
+                kinds.push_back(e.kind);
+                continue;
+            }
+            merged[it->second].dirty.expand(e.dirty);
+            kinds[it->second] = combine(kinds[it->second], e.kind);
+        }
+        pending.clear();
+        size_t kept = 0;
+        for (size_t i = 0; i < merged.size(); ++i) {
+            if (kinds[i] == 0) continue; // додано й вилучено в тому самому пакеті
+            merged[kept] = merged[i];
+            merged[kept].kind = (SceneEvent::Kind)kinds[i];
+            ++kept;
+        }
+        merged.resize(kept);
+        // Обробник може підписатися чи відписатися — обходимо копію
+        auto targets = subscribers;
+        vector<SceneEvent> batch;
+        for (auto& s : targets) {
+            batch.clear();
+            BBox dirty;
+            for (auto& e : merged) {
+                if (!(s.kinds & e.kind)) continue;
+                if (!s.region.empty() && e.kind != SceneEvent::Reset && !e.dirty.intersects(s.region)) continue;
+                batch.push_back(e);
+                dirty.expand(e.dirty);
+            }
+            if (batch.empty()) continue;
+            delivered += batch.size();
+            s.handler(batch, dirty);
+        }
+    }
+
+    size_t publishedCount() const { return published; }
+    size_t deliveredCount() const { return delivered; }
+};
+
+// Команди (Command pattern)
+class Command {
+public:
+    virtual void execute() = 0;
+    virtual void undo() = 0;
+    // Область сцени (у світових координатах), яку змінює execute/undo
+    virtual BBox damage() const = 0;
+    // Об'єкт верхнього рівня, який додає команда (якщо додає)
+    virtual Ref<GraphicObject> added() const { return nullptr; }
+    // Об'єкт, який переміщує команда (якщо переміщує)
+    virtual Ref<GraphicObject> moved() const { return nullptr; }
+    // Подія для шини після виконання (або скасування)
+    virtual SceneEvent event(bool undone) const = 0;
+    // Записує виконання (або скасування) у журнал змін для дельт
+    virtual void recordTo(SceneDelta& journal, bool undone) const = 0;
+    virtual ~Command() = default;
+};
+
+class AddCommand : public Command {
+    vector<Ref<GraphicObject>>& objects;
+    Ref<GraphicObject> obj;
+public:
+    AddCommand(vector<Ref<GraphicObject>>& objs, Ref<GraphicObject> obj)
+        : objects(objs), obj(obj) {}
+    void execute() override { objects.push_back(obj); }
+    void undo() override { if(!objects.empty()) objects.pop_back(); }
+    BBox damage() const override { return obj->bounds(); }
+    Ref<GraphicObject> added() const override { return obj; }
+    SceneEvent event(bool undone) const override {
+        return {undone ? SceneEvent::Removed : SceneEvent::Added, obj->getId(), obj->getId(), obj->bounds()};
+    }
+    void recordTo(SceneDelta& journal, bool undone) const override {
+        if (undone) journal.remove({obj->getId()}, objects.size());
+        else journal.add({}, objects.size() - 1, *obj);
+    }
+};
+
+class MoveCommand : public Command {
+    Ref<GraphicObject> obj;
+    vector<Ref<Group>> path; // групи-предки від верхнього рівня до батька
+    int dx, dy;
+    BBox before; // межі у світових координатах до переміщення
+
+    // Версії предків оновлює сам move
+    void apply(int mx, int my) { obj->move(mx, my); }
+public:
+    MoveCommand(Ref<GraphicObject> obj, vector<Ref<Group>> path, int dx, int dy)
+        : obj(obj), path(move(path)), dx(dx), dy(dy) {
+        int ox = 0, oy = 0;
+        for (auto& grp : this->path) { ox += grp->getX(); oy += grp->getY(); }
+        before = obj->bounds().translated(ox, oy);
+    }
+    void execute() override { apply(dx, dy); }
+    void undo() override { apply(-dx, -dy); }
+    Ref<GraphicObject> moved() const override { return obj; }
+    BBox damage() const override {
+        BBox b = before;
+        b.expand(before.translated(dx, dy));
+        return b;
+    }
+    SceneEvent event(bool) const override {
+        int root = path.empty() ? obj->getId() : path.front()->getId();
+        return {SceneEvent::Moved, obj->getId(), root, damage()};
+    }
+    void recordTo(SceneDelta& journal, bool undone) const override {
+        vector<int> ids;
+        for (auto& grp : path) ids.push_back(grp->getId());
+        ids.push_back(obj->getId());
+        journal.move(ids, undone ? -dx : dx, undone ? -dy : dy);
+    }
+};
+
+// ID-буфер: для кожної цілої точки сцени зберігає ID найглибшого верхнього
+// об'єкта, тож пошук за координатами — один доступ до масиву.
+class PickBuffer {
+    struct Entry {
+        Ref<GraphicObject> obj;
+        long long pixels = 0;
+    };
+    BBox extent;
+    vector<int> ids; // 0 — порожньо
+    unordered_map<int, Entry> table;
+    bool valid = false;
+
+    int& at(int px, int py) {
+        return ids[(size_t)(py - extent.minY) * extent.width() + (px - extent.minX)];
+    }
+    void setPixel(int px, int py, const Ref<GraphicObject>& obj) {
+        int& cell = at(px, py);
+        int newId = obj ? obj->getId() : 0;
+        if (cell == newId) return;
+        if (cell != 0) {
+            auto it = table.find(cell);
+            if (--it->second.pixels == 0) table.erase(it);
+        }
+        if (newId != 0) {
+            auto& e = table[newId];
+            if (!e.obj) e.obj = obj;
+            ++e.pixels;
+        }
+        cell = newId;
+    }
+public:
+    static constexpr long long maxPixels = 1LL << 24;
+    static constexpr int margin = 64; // запас, щоб дрібні зміни не вимагали перевиділення
+
+    bool isValid() const { return valid; }
+    const BBox& getExtent() const { return extent; }
+    void invalidate() { valid = false; ids.clear(); table.clear(); }
+
+    // Повна перебудова під поточні межі сцени; false — сцена завелика для буфера
+    bool rebuild(const vector<Ref<GraphicObject>>& objects) {
+        invalidate();
+        BBox scene;
+        for (auto& obj : objects) scene.expand(obj->bounds());
+        extent = scene.empty() ? BBox(0, 0, 0, 0) : scene.inflated(margin);
+        if (extent.area() > maxPixels) return false;
+        ids.assign((size_t)extent.area(), 0);
+        valid = true;
+        repaint(objects, extent);
+        return true;
+    }
+
+    // Перемальовує лише пошкоджену область
+    void repaint(const vector<Ref<GraphicObject>>& objects, const BBox& damage) {
+        BBox region = damage.intersect(extent);
+        if (!valid || region.empty()) return;
+        for (int py = region.minY; py <= region.maxY; ++py)
+            for (int px = region.minX; px <= region.maxX; ++px)
+                setPixel(px, py, nullptr);
+        for (auto& obj : objects) {
+            forEachLeaf(obj, 0, 0, region, [&](const Ref<GraphicObject>& leaf, int ox, int oy) {
+                BBox b = leaf->bounds().translated(ox, oy).intersect(region);
+                for (int py = b.minY; py <= b.maxY; ++py)
+                    for (int px = b.minX; px <= b.maxX; ++px)
+                        if (leaf->containsPoint(px - ox, py - oy))
+                            setPixel(px, py, leaf);
+            });
+        }
+    }
+
+    Ref<GraphicObject> lookup(int px, int py) {
+        if (!extent.contains(px, py)) return nullptr;
+        int cell = at(px, py);
+        return cell ? table[cell].obj : nullptr;
+    }
+};
+
+// Растр у градаціях сірого: 0 — порожньо, 255 — повне покриття
+struct Framebuffer {
+    BBox extent;
+    vector<uint8_t> pixels;
+    explicit Framebuffer(const BBox& e = BBox())
+        : extent(e), pixels((size_t)e.area(), 0) {}
+    uint8_t& at(int px, int py) {
+        return pixels[(size_t)(py - extent.minY) * extent.width() + (px - extent.minX)];
+    }
+    uint8_t at(int px, int py) const {
+        return pixels[(size_t)(py - extent.minY) * extent.width() + (px - extent.minX)];
+    }
+};
+
+// Вивід растру ASCII-символами за рівнем покриття
+void printRaster(ostream& os, const Framebuffer& fb) {
+    static const string ramp = ".:-=+*#%@";
+    for (int py = fb.extent.minY; py <= fb.extent.maxY; ++py) {
+        for (int px = fb.extent.minX; px <= fb.extent.maxX; ++px) {
+            uint8_t v = fb.at(px, py);
+            os << (v == 0 ? ramp[0] : ramp[1 + v * (ramp.size() - 2) / 255]);
+        }
+        os << "\n";
+    }
+}
+
+// Кеш растру з плиток фіксованого розміру. Плитки, яких торкнулася зміна,
+// позначаються брудними і перерастеризовуються паралельно за власним списком об'єктів.
+class TileCache {
+public:
+    static constexpr int tileSize = 32;
+private:
+    struct LeafRef {
+        Ref<GraphicObject> obj;
+        int ox, oy;
+    };
+    struct Tile {
+        BBox area;
+        vector<uint8_t> pixels = vector<uint8_t>(tileSize * tileSize, 0);
+        vector<LeafRef> objects; // листки, межі яких перетинають плитку, у порядку малювання
+        bool dirty = true;
+    };
+    unordered_map<long long, Tile> tiles;
+    size_t lastRasterized = 0;
+
+    static int tileIndex(int v) { return v >= 0 ? v / tileSize : -((-v + tileSize - 1) / tileSize); }
+    static long long key(int tx, int ty) { return (long long)(((unsigned long long)(unsigned)tx << 32) | (unsigned)ty); }
+
+    static void rasterize(Tile& t) {
+        fill(t.pixels.begin(), t.pixels.end(), 0);
+        for (auto& ref : t.objects) {
+            BBox b = ref.obj->bounds().translated(ref.ox, ref.oy).intersect(t.area);
+            for (int py = b.minY; py <= b.maxY; ++py)
+                for (int px = b.minX; px <= b.maxX; ++px)
+                    if (ref.obj->containsPoint(px - ref.ox, py - ref.oy))
+                        t.pixels[(py - t.area.minY) * tileSize + (px - t.area.minX)] = 255;
+        }
+        t.objects.clear(); // список потрібен лише на час растеризації і не тримає об'єкти живими
+        t.dirty = false;
+    }
+public:
+    // Позначає брудними вже створені плитки; нові плитки створюються брудними при рендері
+    void markDamaged(const BBox& damage) {
+        if (damage.empty()) return;
+        for (int ty = tileIndex(damage.minY); ty <= tileIndex(damage.maxY); ++ty)
+            for (int tx = tileIndex(damage.minX); tx <= tileIndex(damage.maxX); ++tx) {
+                auto it = tiles.find(key(tx, ty));
+                if (it != tiles.end()) it->second.dirty = true;
+            }
+    }
+    void clear() { tiles.clear(); }
+    size_t tileCount() const { return tiles.size(); }
+    size_t lastRasterizedCount() const { return lastRasterized; }
+
+    Framebuffer render(const vector<Ref<GraphicObject>>& objects, const BBox& view) {
+        Framebuffer fb(view);
+        if (view.empty()) return fb;
+        vector<Tile*> dirty;
+        BBox dirtyArea;
+        for (int ty = tileIndex(view.minY); ty <= tileIndex(view.maxY); ++ty)
+            for (int tx = tileIndex(view.minX); tx <= tileIndex(view.maxX); ++tx) {
+                Tile& t = tiles[key(tx, ty)];
+                if (!t.dirty) continue;
+                t.area = BBox(tx * tileSize, ty * tileSize, tx * tileSize + tileSize - 1, ty * tileSize + tileSize - 1);
+                t.objects.clear();
+                dirty.push_back(&t);
+                dirtyArea.expand(t.area);
+            }
+        lastRasterized = dirty.size();
+
+        // Один обхід сцени розкладає листки по списках брудних плиток
+        for (auto& obj : objects) {
+            forEachLeaf(obj, 0, 0, dirtyArea, [&](const Ref<GraphicObject>& leaf, int ox, int oy) {
+                BBox b = leaf->bounds().translated(ox, oy);
+                for (int ty = tileIndex(b.minY); ty <= tileIndex(b.maxY); ++ty)
+                    for (int tx = tileIndex(b.minX); tx <= tileIndex(b.maxX); ++tx) {
+                        auto it = tiles.find(key(tx, ty));
+                        if (it != tiles.end() && it->second.dirty)
+                            it->second.objects.push_back({leaf, ox, oy});
+                    }
+            });
+        }
+
+        atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i; (i = next++) < dirty.size(); )
+                rasterize(*dirty[i]);
+        };
+        size_t threads = min<size_t>(max(1u, thread::hardware_concurrency()), dirty.size());
+        vector<thread> pool;
+        for (size_t i = 1; i < threads; ++i) pool.emplace_back(worker);
+        worker();
+        for (auto& th : pool) th.join();
+
+        for (int py = view.minY; py <= view.maxY; ++py)
+            for (int px = view.minX; px <= view.maxX; ++px) {
+                const Tile& t = tiles[key(tileIndex(px), tileIndex(py))];
+                fb.at(px, py) = t.pixels[(py - t.area.minY) * tileSize + (px - t.area.minX)];
+            }
+        return fb;
+    }
+};
+
+// Вікно растеризації: піксель (i, j) покриває світовий квадрат
+// [originX + i / scale, originX + (i + 1) / scale) і так само по Y.
+struct RasterView {
+    double originX = 0, originY = 0;
+    double scale = 1;
+    int width = 0, height = 0;
+
+    // Вікно, у якому центри пікселів при scale = 1 збігаються з цілими точками
+    static RasterView fit(const BBox& world, double scale) {
+        RasterView v;
+        v.originX = world.minX - 0.5;
+        v.originY = world.minY - 0.5;
+        v.scale = scale;
+        v.width = side(world.width() * scale);
+        v.height = side(world.height() * scale);
+        return v;
+    }
+    // Розмір у пікселях, обмежений діапазоном int (перевіряє викликач)
+    static int side(double extent) {
+        return (int)min(max(1.0, ceil(extent)), (double)numeric_limits<int>::max());
+    }
+    BBox worldArea() const {
+        return BBox((int)floor(originX), (int)floor(originY),
+                    (int)ceil(originX + width / scale), (int)ceil(originY + height / scale));
+    }
+};
+
+// Растеризатор з аналітичним покриттям пікселів для кіл і прямокутників.
+// Фігури розглядаються як області пікселів, які вони займають при точковій
+// вибірці: прямокутник [x - 0.5, x + w + 0.5], коло радіуса r + 0.5.
+class CoverageRasterizer {
+    static float clamp01(float v) { return v < 0 ? 0 : (v > 1 ? 1 : v); }
+    // Межа рядка чи стовпця: обрізається до растру ще в double, бо великі
+    // фігури при великому масштабі виходять за діапазон int
+    static int clampIndex(double v, int lo, int hi) { return (int)min(max(v, (double)lo), (double)hi); }
+
+    // Накладання покриття cov на рядок: dst = dst + cov * (1 - dst)
+    static void circleSpan(float* row, int i0, int i1, float cx, float dy, float r, float weight, bool simd) {
+        int i = i0;
+#ifdef __SSE2__
+        if (simd) {
+            const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+            const __m128 dy2 = _mm_set1_ps(dy * dy), rr = _mm_set1_ps(r + 0.5f);
+            const __m128 w = _mm_set1_ps(weight), step = _mm_set1_ps(4.0f);
+            __m128 dx = _mm_setr_ps(i + 0.5f - cx, i + 1.5f - cx, i + 2.5f - cx, i + 3.5f - cx);
+            for (; i + 4 <= i1; i += 4, dx = _mm_add_ps(dx, step)) {
+                __m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), dy2));
+                __m128 cov = _mm_mul_ps(w, _mm_min_ps(one, _mm_max_ps(zero, _mm_sub_ps(rr, d))));
+                __m128 dst = _mm_loadu_ps(row + i);
+                _mm_storeu_ps(row + i, _mm_add_ps(dst, _mm_mul_ps(cov, _mm_sub_ps(one, dst))));
+            }
+        }
+#endif
+        for (; i < i1; ++i) {
+            float dx = i + 0.5f - cx;
+            float cov = weight * clamp01(r + 0.5f - sqrt(dx * dx + dy * dy));
+            row[i] += cov * (1 - row[i]);
+        }
+    }
+
+    static void rectSpan(float* row, int i0, int i1, float left, float right, float coverY, bool simd) {
+        int i = i0;
+#ifdef __SSE2__
+        if (simd) {
+            const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+            const __m128 l = _mm_set1_ps(left), r = _mm_set1_ps(right);
+            const __m128 cy = _mm_set1_ps(coverY), step = _mm_set1_ps(4.0f);
+            __m128 px = _mm_setr_ps((float)i, i + 1.0f, i + 2.0f, i + 3.0f);
+            for (; i + 4 <= i1; i += 4, px = _mm_add_ps(px, step)) {
+                __m128 overlap = _mm_sub_ps(_mm_min_ps(_mm_add_ps(px, one), r), _mm_max_ps(px, l));
+                __m128 cov = _mm_mul_ps(cy, _mm_min_ps(one, _mm_max_ps(zero, overlap)));
+                __m128 dst = _mm_loadu_ps(row + i);
+                _mm_storeu_ps(row + i, _mm_add_ps(dst, _mm_mul_ps(cov, _mm_sub_ps(one, dst))));
+            }
+        }
+#endif
+        for (; i < i1; ++i) {
+            float cov = coverY * clamp01(min(i + 1.0f, right) - max((float)i, left));
+            row[i] += cov * (1 - row[i]);
+        }
+    }
+
+public:
+    // Накладає покриття одного листка (зі світовим зсувом ox, oy) на рядки
+    // [rowBegin, rowEnd) вікна view; acc містить лише ці рядки
+    static void renderLeaf(vector<float>& acc, const RasterView& v, const GraphicObject& leaf, int ox, int oy, bool simd,
+                           int rowBegin = 0, int rowEnd = -1) {
+        if (rowEnd < 0) rowEnd = v.height;
+        float s = (float)v.scale;
+        if (auto c = shapeCast<Circle>(&leaf)) {
+            float cx = (float)((c->getX() + ox - v.originX) * v.scale);
+            float cy = (float)((c->getY() + oy - v.originY) * v.scale);
+            float r = (c->getRadius() + 0.5f) * s;
+            // Коло, менше за піксель, вносить покриття пропорційно своїй площі
+            float weight = min(1.0f, 3.14159265f * r * r);
+            int j0 = clampIndex(floor(cy - r), rowBegin, rowEnd), j1 = clampIndex(ceil(cy + r) + 1.0, rowBegin, rowEnd);
+            int i0 = clampIndex(floor(cx - r), 0, v.width), i1 = clampIndex(ceil(cx + r) + 1.0, 0, v.width);
+            for (int j = j0; j < j1; ++j)
+                circleSpan(&acc[(size_t)(j - rowBegin) * v.width], i0, i1, cx, j + 0.5f - cy, r, weight, simd);
+        } else if (auto rc = shapeCast<Rectangle>(&leaf)) {
+            float left = (float)((rc->getX() + ox - 0.5 - v.originX) * v.scale);
+            float top = (float)((rc->getY() + oy - 0.5 - v.originY) * v.scale);
+            float right = left + (rc->getWidth() + 1) * s;
+            float bottom = top + (rc->getHeight() + 1) * s;
+            int j0 = clampIndex(floor(top), rowBegin, rowEnd), j1 = clampIndex(ceil(bottom), rowBegin, rowEnd);
+            int i0 = clampIndex(floor(left), 0, v.width), i1 = clampIndex(ceil(right), 0, v.width);
+            for (int j = j0; j < j1; ++j) {
+                float coverY = clamp01(min(j + 1.0f, bottom) - max((float)j, top));
+                rectSpan(&acc[(size_t)(j - rowBegin) * v.width], i0, i1, left, right, coverY, simd);
+            }
+        }
+    }
+
+    // Рендер смуги рядків [row0, row1) вікна view у fb (розміру view). Смуги
+    // незалежні, тож растр можна будувати частинами з тим самим результатом.
+    static void renderBand(const vector<Ref<GraphicObject>>& objects, const RasterView& view, int supersample, bool simd,
+                           int row0, int row1, Framebuffer& fb) {
+        supersample = max(1, supersample);
+        row0 = max(0, row0);
+        row1 = min(view.height, row1);
+        if (row0 >= row1) return;
+        RasterView hi = view;
+        hi.scale *= supersample;
+        hi.width *= supersample;
+        hi.height *= supersample;
+        int hiBegin = row0 * supersample, hiEnd = row1 * supersample;
+        vector<float> acc((size_t)hi.width * (hiEnd - hiBegin), 0.0f);
+        // Світова область смуги із запасом: renderLeaf однаково обрізає по рядках
+        BBox area = view.worldArea();
+        area.minY = (int)floor(view.originY + row0 / view.scale) - 1;
+        area.maxY = (int)ceil(view.originY + row1 / view.scale) + 1;
+        for (auto& obj : objects)
+            forEachLeaf(obj, 0, 0, area, [&](const Ref<GraphicObject>& leaf, int ox, int oy) {
+                renderLeaf(acc, hi, *leaf, ox, oy, simd, hiBegin, hiEnd);
+            });
+
+        float norm = 255.0f / (supersample * supersample);
+        for (int j = row0; j < row1; ++j)
+            for (int i = 0; i < view.width; ++i) {
+                float sum = 0;
+                for (int sj = 0; sj < supersample; ++sj)
+                    for (int si = 0; si < supersample; ++si)
+                        sum += acc[(size_t)((j - row0) * supersample + sj) * hi.width + i * supersample + si];
+                fb.at(i, j) = (uint8_t)lround(sum * norm);
+            }
+    }
+
+    // supersample — кількість підвибірок на піксель по кожній осі (1, 2, 4, ...)
+    static Framebuffer render(const vector<Ref<GraphicObject>>& objects, const RasterView& view,
+                              int supersample = 1, bool simd = true) {
+        Framebuffer fb(BBox(0, 0, view.width - 1, view.height - 1));
+        renderBand(objects, view, supersample, simd, 0, view.height, fb);
+        return fb;
+    }
+
+    // Точкова вибірка без згладжування (той самий шлях, що й containsPoint)
+    static Framebuffer renderAliased(const vector<Ref<GraphicObject>>& objects, const RasterView& view) {
+        Framebuffer fb(BBox(0, 0, view.width - 1, view.height - 1));
+        BBox area = view.worldArea();
+        for (auto& obj : objects)
+            forEachLeaf(obj, 0, 0, area, [&](const Ref<GraphicObject>& leaf, int ox, int oy) {
+                BBox b = leaf->bounds().translated(ox, oy);
+                int i0 = max(0, (int)floor((b.minX - 0.5 - view.originX) * view.scale));
+                int i1 = min(view.width - 1, (int)ceil((b.maxX + 0.5 - view.originX) * view.scale));
+                int j0 = max(0, (int)floor((b.minY - 0.5 - view.originY) * view.scale));
+                int j1 = min(view.height - 1, (int)ceil((b.maxY + 0.5 - view.originY) * view.scale));
+                for (int j = j0; j <= j1; ++j) {
+                    int py = (int)lround(view.originY + (j + 0.5) / view.scale) - oy;
+                    for (int i = i0; i <= i1; ++i) {
+                        int px = (int)lround(view.originX + (i + 0.5) / view.scale) - ox;
+                        if (leaf->containsPoint(px, py)) fb.at(i, j) = 255;
+                    }
+                }
+            });
+        return fb;
+    }
+};
+
+// Запис растру у форматі PGM (P5)
+bool exportPGM(const Framebuffer& fb, const string& path) {
+    ofstream out(path, ios::binary);
+    if (!out) return false;
+    out << "P5\n" << fb.extent.width() << " " << fb.extent.height() << "\n255\n";
+    out.write((const char*)fb.pixels.data(), (streamsize)fb.pixels.size());
+    return (bool)out;
+}
+
+// Рендер з рівнями деталізації: на рівні level один піксель покриває
+// 2^level світових одиниць. Плитки кожного рівня кешуються окремо; листки,
+// менші за піксель, додають покриття пропорційно площі, а дрібні групи
+// підставляються як кешовані зображення-замінники (impostor) без обходу дітей.
+class LodRenderer {
+public:
+    static constexpr int tileSize = 32;
+    static constexpr int maxLevel = 12;
+    static constexpr int impostorPixels = 4; // група до 4x4 пікселів малюється замінником
+private:
+    struct Tile {
+        vector<float> cov = vector<float>(tileSize * tileSize, 0.0f);
+        bool dirty = true;
+    };
+    struct Impostor {
+        BBox bounds;       // світові межі групи, для якої побудовано замінник
+        int i0, j0, w, h;  // піксельне вікно на сітці рівня
+        vector<float> cov;
+    };
+    unordered_map<long long, Tile> tiles[maxLevel + 1];
+    unordered_map<int, Impostor> impostors[maxLevel + 1]; // ключ — ID групи
+    mutex impostorMutex;
+    size_t lastRasterized = 0;
+
+    static long long key(int tx, int ty) { return (long long)(((unsigned long long)(unsigned)tx << 32) | (unsigned)ty); }
+    static int floorDiv(int v, int d) { return v >= 0 ? v / d : -((-v + d - 1) / d); }
+    // Піксель рівня level, якому належить світова точка
+    static int pixelOf(int v, int level) { return floorDiv(v, 1 << level); }
+
+    static RasterView pixelWindow(int i0, int j0, int w, int h, int level) {
+        RasterView v;
+        v.scale = 1.0 / (1 << level);
+        v.originX = (double)i0 * (1 << level) - 0.5;
+        v.originY = (double)j0 * (1 << level) - 0.5;
+        v.width = w;
+        v.height = h;
+        return v;
+    }
+
+    static void blend(float& dst, float cov) { dst += cov * (1 - dst); }
+
+    // Замінник повертається копією: він не більший за impostorPixels^2 і так
+    // безпечно ділиться між потоками, що растеризують сусідні плитки
+    Impostor impostorFor(const Group& grp, const BBox& b, int ox, int oy, int level) {
+        {
+            lock_guard<mutex> lock(impostorMutex);
+            auto it = impostors[level].find(grp.getId());
+            if (it != impostors[level].end() && it->second.bounds.minX == b.minX && it->second.bounds.minY == b.minY
+                && it->second.bounds.maxX == b.maxX && it->second.bounds.maxY == b.maxY)
+                return it->second;
+        }
+        Impostor imp;
+        imp.bounds = b;
+        imp.i0 = pixelOf(b.minX, level);
+        imp.j0 = pixelOf(b.minY, level);
+        imp.w = pixelOf(b.maxX, level) - imp.i0 + 1;
+        imp.h = pixelOf(b.maxY, level) - imp.j0 + 1;
+        imp.cov.assign((size_t)imp.w * imp.h, 0.0f);
+        RasterView v = pixelWindow(imp.i0, imp.j0, imp.w, imp.h, level);
+        BBox area = v.worldArea();
+        for (auto& child : grp.getChildren())
+            splat(imp.cov, v, area, child, ox + grp.getX(), oy + grp.getY(), level);
+        lock_guard<mutex> lock(impostorMutex);
+        impostors[level][grp.getId()] = imp;
+        return imp;
+    }
+
+    // area — світова область вікна v, обчислюється викликачем один раз
+    void splat(vector<float>& acc, const RasterView& v, const BBox& area, const Ref<GraphicObject>& obj,
+               int ox, int oy, int level) {
+        BBox b = obj->bounds().translated(ox, oy);
+        if (!b.intersects(area)) return;
+        int px = 1 << level;
+        if (auto grp = shapeCast<Group>(obj.get())) {
+            if (level > 0 && b.width() <= impostorPixels * px && b.height() <= impostorPixels * px) {
+                Impostor imp = impostorFor(*grp, b, ox, oy, level);
+                int vi = (int)lround((v.originX + 0.5) / px), vj = (int)lround((v.originY + 0.5) / px);
+                for (int j = 0; j < imp.h; ++j) {
+                    int tj = imp.j0 + j - vj;
+                    if (tj < 0 || tj >= v.height) continue;
+                    for (int i = 0; i < imp.w; ++i) {
+                        int ti = imp.i0 + i - vi;
+                        if (ti >= 0 && ti < v.width)
+                            blend(acc[(size_t)tj * v.width + ti], imp.cov[(size_t)j * imp.w + i]);
+                    }
+                }
+                return;
+            }
+            for (auto& child : grp->getChildren())
+                splat(acc, v, area, child, ox + grp->getX(), oy + grp->getY(), level);
+            return;
+        }
+        if (level > 0 && b.width() <= px && b.height() <= px) {
+            // Листок менший за піксель: покриття пропорційне площі
+            double area;
+            if (auto c = shapeCast<Circle>(obj.get())) area = 3.14159265 * (c->getRadius() + 0.5) * (c->getRadius() + 0.5);
+            else area = (double)b.area();
+            int vi = (int)lround((v.originX + 0.5) / px), vj = (int)lround((v.originY + 0.5) / px);
+            int ti = pixelOf(obj->getX() + ox, level) - vi, tj = pixelOf(obj->getY() + oy, level) - vj;
+            if (ti >= 0 && ti < v.width && tj >= 0 && tj < v.height)
+                blend(acc[(size_t)tj * v.width + ti], (float)min(1.0, area / ((double)px * px)));
+            return;
+        }
+        CoverageRasterizer::renderLeaf(acc, v, *obj, ox, oy, true);
+    }
+public:
+    void markDamaged(const BBox& damage) {
+        if (damage.empty()) return;
+        for (int level = 0; level <= maxLevel; ++level) {
+            int span = tileSize << level;
+            for (int ty = floorDiv(damage.minY, span); ty <= floorDiv(damage.maxY, span); ++ty)
+                for (int tx = floorDiv(damage.minX, span); tx <= floorDiv(damage.maxX, span); ++tx) {
+                    auto it = tiles[level].find(key(tx, ty));
+                    if (it != tiles[level].end()) it->second.dirty = true;
+                }
+            for (auto it = impostors[level].begin(); it != impostors[level].end(); ) {
+                if (it->second.bounds.intersects(damage)) it = impostors[level].erase(it);
+                else ++it;
+            }
+        }
+    }
+    size_t lastRasterizedCount() const { return lastRasterized; }
+
+    // Растр світової області view на рівні level (кожен піксель — 2^level одиниць)
+    Framebuffer render(const vector<Ref<GraphicObject>>& objects, const BBox& view, int level) {
+        level = max(0, min(maxLevel, level));
+        if (view.empty()) return Framebuffer();
+        BBox pixels(pixelOf(view.minX, level), pixelOf(view.minY, level),
+                    pixelOf(view.maxX, level), pixelOf(view.maxY, level));
+        Framebuffer fb(pixels);
+
+        struct Job {
+            Tile* tile;
+            RasterView view;
+            vector<const Ref<GraphicObject>*> objects; // об'єкти верхнього рівня, що перетинають плитку
+        };
+        vector<Job> dirty;
+        unordered_map<long long, size_t> dirtyIndex;
+        auto& levelTiles = tiles[level];
+        for (int ty = floorDiv(pixels.minY, tileSize); ty <= floorDiv(pixels.maxY, tileSize); ++ty)
+            for (int tx = floorDiv(pixels.minX, tileSize); tx <= floorDiv(pixels.maxX, tileSize); ++tx) {
+                Tile& t = levelTiles[key(tx, ty)];
+                if (!t.dirty) continue;
+                dirtyIndex[key(tx, ty)] = dirty.size();
+                dirty.push_back({&t, pixelWindow(tx * tileSize, ty * tileSize, tileSize, tileSize, level), {}});
+            }
+        lastRasterized = dirty.size();
+
+        // Один прохід розкладає об'єкти по брудних плитках
+        int span = tileSize << level;
+        if (!dirty.empty())
+            for (auto& obj : objects) {
+                BBox b = obj->bounds();
+                for (int ty = floorDiv(b.minY, span); ty <= floorDiv(b.maxY, span); ++ty)
+                    for (int tx = floorDiv(b.minX, span); tx <= floorDiv(b.maxX, span); ++tx) {
+                        auto it = dirtyIndex.find(key(tx, ty));
+                        if (it != dirtyIndex.end()) dirty[it->second].objects.push_back(&obj);
+                    }
+            }
+
+        atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i; (i = next++) < dirty.size(); ) {
+                Job& job = dirty[i];
+                fill(job.tile->cov.begin(), job.tile->cov.end(), 0.0f);
+                BBox area = job.view.worldArea();
+                for (auto obj : job.objects)
+                    splat(job.tile->cov, job.view, area, *obj, 0, 0, level);
+                job.tile->dirty = false;
+            }
+        };
+        size_t threads = min<size_t>(max(1u, thread::hardware_concurrency()), dirty.size());
+        vector<thread> pool;
+        for (size_t i = 1; i < threads; ++i) pool.emplace_back(worker);
+        worker();
+        for (auto& th : pool) th.join();
+
+        for (int j = pixels.minY; j <= pixels.maxY; ++j)
+            for (int i = pixels.minX; i <= pixels.maxX; ++i) {
+                const Tile& t = levelTiles[key(floorDiv(i, tileSize), floorDiv(j, tileSize))];
+                float c = t.cov[(j - floorDiv(j, tileSize) * tileSize) * tileSize + (i - floorDiv(i, tileSize) * tileSize)];
+                fb.at(i, j) = (uint8_t)lround(min(1.0f, c) * 255);
+            }
+        return fb;
+    }
+};
+
+// Фасад
+// Довга операція, що виконується порціями між опитуваннями вводу. До finish
+// сцена не змінюється, тож скасування на будь-якому кроці нічого не залишає.
+class Job {
+public:
+    virtual ~Job() = default;
+    // Виконує порцію роботи (кілька мілісекунд); false — роботу завершено
+    virtual bool step() = 0;
+    // Частка виконаної роботи, 0..1
+    virtual double progress() const = 0;
+    // Застосовує результат; false — помилка (повідомлення виведено)
+    virtual bool finish() = 0;
+    // Звільняє проміжні ресурси скасованої операції
+    virtual void cancel() {}
+};
+
+// Повний запис сцени у файл через SceneFile::Writer; done отримує результат commit
+class SaveJob : public Job {
+public:
+    using Done = function<void(const SceneFile::SaveStats&, SceneFile::ChunkIndex&)>;
+private:
+    SceneFile::Writer writer;
+    Done done;
+public:
+    SaveJob(const string& path, const vector<Ref<GraphicObject>>& objects, Done done)
+        : writer(path, objects), done(std::move(done)) {}
+    bool step() override { return writer.step(); }
+    double progress() const override { return writer.total() ? (double)writer.done() / writer.total() : 1.0; }
+    bool finish() override {
+        SceneFile::ChunkIndex index;
+        auto stats = writer.commit(&index);
+        done(stats, index);
+        return true;
+    }
+    void cancel() override { writer.abort(); }
+};
+
+// Згладжений растр смугами рядків із записом у PGM наприкінці
+class ExportJob : public Job {
+    vector<Ref<GraphicObject>> objects;
+    RasterView view;
+    int supersample;
+    string path;
+    Framebuffer fb; // виділяється першим кроком, щоб нестача пам'яті стала помилкою завдання
+    int row = 0;
+public:
+    // Найбільший растр експорту: обмежує пам'ять і тримає розміри підвибірок у межах int
+    static constexpr int maxSide = 1 << 16;
+    static constexpr int64_t maxPixels = (int64_t)1 << 26;
+    static bool fits(const RasterView& view) {
+        return view.width <= maxSide && view.height <= maxSide && (int64_t)view.width * view.height <= maxPixels;
+    }
+
+    ExportJob(const vector<Ref<GraphicObject>>& objects, const RasterView& view, int supersample, const string& path)
+        : objects(objects), view(view), supersample(supersample), path(path) {}
+    bool step() override {
+        if (fb.pixels.empty()) fb = Framebuffer(BBox(0, 0, view.width - 1, view.height - 1));
+        // Смуга приблизно з мільйона підвибірок
+        int64_t rowSamples = (int64_t)view.width * supersample * supersample;
+        int rows = (int)max<int64_t>(1, 1000000 / rowSamples);
+        CoverageRasterizer::renderBand(objects, view, supersample, true, row, row + rows, fb);
+        row = min(view.height, row + rows);
+        return row < view.height;
+    }
+    double progress() const override { return (double)row / view.height; }
+    bool finish() override {
+        if (exportPGM(fb, path)) return true;
+        cout << "Не вдалося записати файл.\n";
+        return false;
+    }
+    const Framebuffer& result() const { return fb; }
+};
+
+// Вибірка запитом порціями коренів пошуку
+class QueryJob : public Job {
+    SceneQuery query;
+    SceneQuery::Execution execution; // посилається на query, тож оголошене після нього
+    vector<SceneQuery::Match>& out;
+    size_t batch;
+public:
+    QueryJob(SceneQuery q, const vector<Ref<GraphicObject>>& objects, vector<SceneQuery::Match>& out)
+        : query(std::move(q)), execution(query, objects), out(out),
+          batch(4 * max(1u, thread::hardware_concurrency())) {}
+    bool step() override { return execution.step(batch); }
+    double progress() const override { return execution.progress(); }
+    bool finish() override {
+        out = execution.matches();
+        return true;
+    }
+};
+
+// Копія сцени, яка будується по вузлу за раз: групи відтворюються з явним
+// стеком замість рекурсивного clone. Готова копія — одна група зі зсувом dx, dy,
+// яку done додає до сцени.
+class CloneJob : public Job {
+    struct Frame {
+        Ref<Group> source; // порожній — верхній рівень
+        size_t next;
+        Ref<Group> copy;
+    };
+    vector<Ref<GraphicObject>> objects;
+    vector<Frame> stack;
+    Ref<Group> result;
+    size_t copied = 0, total;
+    function<void(Ref<GraphicObject>)> done;
+public:
+    CloneJob(const vector<Ref<GraphicObject>>& objects, int dx, int dy, size_t total,
+             function<void(Ref<GraphicObject>)> done)
+        : objects(objects), result(makeRef<Group>(dx, dy)), total(max<size_t>(1, total)), done(std::move(done)) {
+        stack.push_back({Ref<Group>(), 0, result});
+    }
+    bool step() override {
+        for (int budget = 4096; budget > 0 && !stack.empty(); --budget) {
+            Frame& f = stack.back();
+            const Ref<GraphicObject>* children = f.source ? f.source->getChildren().begin() : objects.data();
+            size_t count = f.source ? f.source->getChildren().size() : objects.size();
+            if (f.next == count) {
+                stack.pop_back();
+                continue;
+            }
+            const Ref<GraphicObject>& child = children[f.next++];
+            ++copied;
+            if (auto grp = refCast<Group>(child)) {
+                auto copy = makeRef<Group>(grp->getX(), grp->getY());
+                f.copy->add(copy);
+                stack.push_back({grp, 0, copy});
+            } else {
+                f.copy->add(child->clone());
+            }
+        }
+        return !stack.empty();
+    }
+    double progress() const override { return min(1.0, (double)copied / total); }
+    bool finish() override {
+        done(result);
+        return true;
+    }
+};
+
+class EditorFacade {
+    vector<Ref<GraphicObject>> objects;
+    stack<shared_ptr<Command>> undoStack, redoStack;
+    PickBuffer pick;
+    bool pickMode = false;
+    TileCache tiles;
+    LodRenderer lod;
+    BBox viewport; // порожня — переглядається вся сцена
+    PageManager pager;
+    string scenePath;                 // файл, з яким синхронізовано savedChunks
+    SceneFile::ChunkIndex savedChunks; // записи останнього збереження з версіями об'єктів
+    SceneFile::SaveStats lastSave;
+    SceneDelta journal; // зміни після останньої виданої або застосованої дельти
+    unordered_map<int, GraphicObject*> topLevel; // ID → об'єкт верхнього рівня
+    SubtreeStats totals; // показники всієї сцени
+    SceneEventBus events;
+
+    // Спільне редагування (див. ReplicatedScene): команди редактора стають
+    // операціями репліки, а злитий з іншими копіями стан замінює сцену
+    unique_ptr<ReplicatedScene> replica;
+    unordered_map<int, uint64_t> elementOf; // ID об'єкта сцени → елемент репліки
+
+    // Просторовий індекс над межами об'єктів верхнього рівня для пошуку за
+    // координатами й областю. Будується у фоновому потоці зі знімка меж і
+    // підміняється атомарно; поки його немає або сцена змінилася після знімка
+    // (інше покоління), пошук переглядає список.
+    struct HitIndex {
+        unique_ptr<SpatialIndex> tree;
+        uint64_t generation = 0;
+    };
+    SpatialIndexKind indexKind = SpatialIndexKind::Auto;
+    shared_ptr<const HitIndex> hitIndex; // лише через atomic_load / atomic_store
+    uint64_t sceneGeneration = 0;        // +1 на пакет змін, який не вкладається в поправки
+    // Поправки до знімка поточного покоління: у знімку hitCount об'єктів (0 —
+    // знімка немає), останній з ID hitLastId; hitMoved — упорядковані позиції,
+    // чиї межі відтоді змінилися, а дописані в кінець (від hitCount) у знімок не
+    // потрапили. Ті й інші перевіряються напряму, тож переміщення й додавання
+    // не знецінюють індекс, доки поправок небагато.
+    size_t hitCount = 0;
+    int hitLastId = 0;
+    vector<uint32_t> hitMoved;
+    static constexpr size_t hitOverlayLimit = 256;
+    thread indexBuilder;
+    atomic<bool> indexBuilding{false}, stopIndexBuild{false};
+    vector<uint32_t> hitCandidates;
+
+#ifdef LB5_HAVE_FORK
+    // Фонове збереження: дочірній процес після fork бачить знімок сцени
+    // (сторінки пам'яті копіюються лише при змінах) і пише його у файл, а
+    // прогрес і розташування записів передає каналом. Повідомлення каналу:
+    // довжина, тег і varint-поля: 'P' готово/усього, 'C' ID/зміщення/довжина/версія...,
+    // 'E' записано байт, 'F' текст помилки.
+    struct BackgroundSave {
+        pid_t pid = -1;
+        int channel = -1;
+        string path;
+        vector<uint8_t> inbox;
+        size_t done = 0, total = 0;
+        SceneFile::ChunkIndex index; // версії — як у знімку, тож змінені після fork записи застарілі
+        bool finished = false;
+        string error;
+        uint64_t written = 0;
+    };
+    unique_ptr<BackgroundSave> background;
+
+    // Дочірній процес: пише сцену й завершується без деструкторів і буферів батька
+    [[noreturn]] void backgroundSaveChild(const string& path, int out) {
+        auto send = [out](const ByteWriter& msg, bool mustDeliver) {
+            ByteWriter frame;
+            frame.varint(msg.size());
+            frame.raw(msg.data().data(), msg.size());
+            const uint8_t* p = frame.data().data();
+            size_t left = frame.size();
+            while (left > 0) {
+                ssize_t n = write(out, p, left);
+                if (n < 0) {
+                    // Прогрес не варто чекати: якщо канал повний, повідомлення пропускається
+                    if (errno == EAGAIN && !mustDeliver && left == frame.size()) return;
+                    if (errno == EINTR || errno == EAGAIN) continue;
+                    _exit(1);
+                }
+                p += n;
+                left -= (size_t)n;
+            }
+        };
+        fcntl(out, F_SETFL, O_NONBLOCK);
+        ByteWriter msg;
+        try {
+            SceneFile::ChunkIndex index;
+            auto stats = SceneFile::save(path, objects, &index, [&](size_t done, size_t total) {
+                ByteWriter p;
+                p.varint('P');
+                p.varint(done);
+                p.varint(total);
+                send(p, false);
+            });
+            fcntl(out, F_SETFL, 0);
+            size_t n = 0;
+            for (auto& e : index) {
+                if (n == 0) msg.varint('C');
+                msg.varint((uint64_t)e.first);
+                msg.varint(e.second.offset);
+                msg.varint(e.second.length);
+                msg.varint(e.second.version);
+                if (++n == 1024) { send(msg, true); msg = ByteWriter(); n = 0; }
+            }
+            if (n) { send(msg, true); msg = ByteWriter(); }
+            msg.varint('E');
+            msg.varint(stats.written);
+        } catch (const exception& e) {
+            fcntl(out, F_SETFL, 0);
+            msg = ByteWriter();
+            msg.varint('F');
+            string text = e.what();
+            msg.raw((const uint8_t*)text.data(), text.size());
+        }
+        send(msg, true);
+        _exit(0);
+    }
+
+    // Розбирає повні повідомлення з inbox
+    void readBackgroundMessages() {
+        BackgroundSave& bg = *background;
+        ByteReader r(bg.inbox);
+        size_t used = 0;
+        while (!r.atEnd()) {
+            size_t len;
+            try { len = r.varint(); } catch (const runtime_error&) { break; }
+            if (len > r.remaining()) break;
+            ByteReader m(r.position(), len);
+            r.skip(len);
+            used = r.consumed();
+            uint64_t tag = m.varint();
+            if (tag == 'P') {
+                bg.done = m.varint();
+                bg.total = m.varint();
+            } else if (tag == 'C') {
+                while (!m.atEnd()) {
+                    int id = (int)m.varint();
+                    SceneFile::Chunk c;
+                    c.offset = m.varint();
+                    c.length = m.varint();
+                    c.version = m.varint();
+                    bg.index[id] = c;
+                }
+            } else if (tag == 'E') {
+                bg.written = m.varint();
+                bg.finished = true;
+            } else if (tag == 'F') {
+                bg.error.assign((const char*)m.position(), m.remaining());
+            }
+        }
+        bg.inbox.erase(bg.inbox.begin(), bg.inbox.begin() + used);
+    }
+
+    // Забирає повідомлення процесу збереження; wait — дочекатися його завершення
+    void collectBackgroundSave(bool wait) {
+        if (!background) return;
+        BackgroundSave& bg = *background;
+        fcntl(bg.channel, F_SETFL, wait ? 0 : O_NONBLOCK);
+        uint8_t buf[65536];
+        while (true) {
+            ssize_t n = read(bg.channel, buf, sizeof buf);
+            if (n > 0) {
+                bg.inbox.insert(bg.inbox.end(), buf, buf + n);
+                readBackgroundMessages();
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return; // канал порожній, процес ще працює
+            break;             // кінець каналу: процес завершився
+        }
+        close(bg.channel);
+        int status = 0;
+        while (waitpid(bg.pid, &status, 0) < 0 && errno == EINTR) {}
+        if (bg.finished) {
+            savedChunks = std::move(bg.index);
+            scenePath = bg.path;
+            lastSave.written = bg.written;
+            lastSave.full = true;
+            cout << "Фонове збереження у " << bg.path << " завершено (записано " << bg.written << " байт).\n";
+        } else {
+            cout << "Фонове збереження у " << bg.path << " не вдалося"
+                 << (bg.error.empty() ? string(": процес аварійно завершився") : ": " + bg.error) << ".\n";
+        }
+        background.reset();
+    }
+#endif
+
+    BBox sceneBounds() const {
+        BBox b;
+        for (auto& obj : objects) b.expand(obj->bounds());
+        return b;
+    }
+
+    // Оновлення растрових кешів після зміни області сцени
+    void onDamage(const BBox& damage) {
+        tiles.markDamaged(damage);
+        lod.markDamaged(damage);
+        if (!pickMode) return;
+        if (!pick.isValid() || !pick.getExtent().contains(sceneBounds())) {
+            if (!pick.rebuild(objects)) {
+                pickMode = false;
+                cout << "Сцена завелика для ID-буфера, режим вимкнено.\n";
+            }
+        } else {
+            pick.repaint(objects, damage);
+        }
+    }
+
+    // Після execute/undo: оновити індекс верхнього рівня й журнал, сповістити шину
+    void applied(const Command& cmd, bool undone) {
+        if (auto obj = cmd.added()) {
+            if (undone) {
+                topLevel.erase(obj->getId());
+                totals -= obj->stats();
+                pager.untrack(obj->getId());
+            } else {
+                topLevel[obj->getId()] = obj.get();
+                totals += obj->stats();
+                if (pager.getBudget())
+                    if (auto grp = refCast<Group>(obj)) pager.track(grp);
+            }
+        }
+        cmd.recordTo(journal, undone);
+        if (replica) replicate(cmd, undone);
+        events.publish(cmd.event(undone));
+    }
+
+    // Операції репліки для виконаної (або скасованої) команди
+    void replicate(const Command& cmd, bool undone) {
+        if (auto obj = cmd.added()) {
+            if (undone) {
+                replica->remove(elementOf.at(obj->getId()));
+                return;
+            }
+            // Команда додає об'єкт у кінець: після попереднього верхнього
+            uint64_t after = objects.size() > 1 ? elementOf.at(objects[objects.size() - 2]->getId()) : 0;
+            replica->insert(0, after, *obj, &elementOf);
+        } else if (auto obj = cmd.moved()) {
+            replica->move(elementOf.at(obj->getId()), obj->getX(), obj->getY());
+        }
+    }
+    // Сцену змінено повз команди: у репліці її вміст замінюється поточним
+    void resyncReplica() {
+        if (!replica) return;
+        for (uint64_t elem : replica->contents(0)) replica->remove(elem);
+        elementOf.clear();
+        uint64_t after = 0;
+        for (auto& obj : objects) after = replica->insert(0, after, *obj, &elementOf);
+    }
+    static uint32_t nextReplicaId() {
+        static atomic<uint32_t> counter{0};
+        return ++counter;
+    }
+
+    // Замінює сцену цілком і очищує історію дій
+    void replaceScene(vector<Ref<GraphicObject>> replaced, bool knownBase) {
+        // Побудова для старої сцени індексувала б застарілий знімок меж
+        stopHitIndexBuild();
+        BBox damage = sceneBounds();
+        objects = std::move(replaced);
+        topLevel.clear();
+        totals = SubtreeStats();
+        for (auto& obj : objects) {
+            topLevel[obj->getId()] = obj.get();
+            totals += obj->stats();
+        }
+        resetJournal(knownBase);
+        while (!undoStack.empty()) undoStack.pop();
+        while (!redoStack.empty()) redoStack.pop();
+        pager.reset();
+        if (pager.getBudget())
+            for (auto& obj : objects)
+                if (auto grp = refCast<Group>(obj)) pager.track(grp);
+        damage.expand(sceneBounds());
+        events.publish({SceneEvent::Reset, 0, 0, damage});
+        startHitIndexBuild();
+    }
+
+    // Запускає фонову побудову індексу, якщо сцена велика, а індекс застарів
+    void startHitIndexBuild() {
+        if (objects.size() < hitIndexThreshold || indexBuilding) return;
+        auto current = atomic_load(&hitIndex);
+        if (current && current->generation == sceneGeneration) return;
+        if (indexBuilder.joinable()) indexBuilder.join();
+        // Межі знімаються тут: потік не читає сцену, яку меню тим часом змінює
+        vector<BBox> snapshot;
+        snapshot.reserve(objects.size());
+        for (auto& obj : objects) snapshot.push_back(obj->bounds());
+        hitCount = objects.size();
+        hitLastId = objects.back()->getId();
+        hitMoved.clear();
+        indexBuilding = true;
+        uint64_t generation = sceneGeneration;
+        indexBuilder = thread([this, generation, kind = indexKind, snapshot = std::move(snapshot)]() mutable {
+            auto index = make_shared<HitIndex>();
+            index->generation = generation;
+            index->tree = makeSpatialIndex(kind, snapshot);
+            if (index->tree->build(std::move(snapshot), &stopIndexBuild))
+                atomic_store(&hitIndex, shared_ptr<const HitIndex>(std::move(index)));
+            indexBuilding = false;
+        });
+    }
+    // Пакет змін для індексу: переміщення (зокрема всередині груп верхнього
+    // рівня) і дописування в кінець стають поправками; вставка чи видалення
+    // всередині знімка, заміна сцени або забагато поправок — нове покоління
+    void noteHitChanges(const vector<SceneEvent>& batch) {
+        bool absorbed = hitCount != 0;
+        for (size_t k = 0; absorbed && k < batch.size(); ++k) {
+            const SceneEvent& e = batch[k];
+            auto it = topLevel.find(e.rootId);
+            if (e.kind == SceneEvent::Removed && e.id == e.rootId && it == topLevel.end()) continue;
+            if (it == topLevel.end() || (e.kind != SceneEvent::Moved && e.kind != SceneEvent::Added &&
+                                         e.kind != SceneEvent::Removed)) {
+                absorbed = false;
+                break;
+            }
+            // Позиція кореня; дописані шукаються першими й перевіряються напряму
+            size_t p = objects.size();
+            while (p > 0 && objects[p - 1].get() != it->second) --p;
+            if (p == 0 || p - 1 >= hitCount) continue;
+            if (e.kind == SceneEvent::Added && e.id == e.rootId) {
+                absorbed = false;
+                break;
+            }
+            --p;
+            auto at = lower_bound(hitMoved.begin(), hitMoved.end(), (uint32_t)p);
+            if (at == hitMoved.end() || *at != p) hitMoved.insert(at, (uint32_t)p);
+        }
+        // Видалено лише дописані: перші hitCount об'єктів лишилися на місцях
+        if (absorbed && (objects.size() < hitCount || objects[hitCount - 1]->getId() != hitLastId)) absorbed = false;
+        if (absorbed && hitMoved.size() + (objects.size() - hitCount) > hitOverlayLimit) absorbed = false;
+        if (absorbed) return;
+        ++sceneGeneration;
+        hitCount = 0;
+        hitMoved.clear();
+    }
+    void stopHitIndexBuild() {
+        stopIndexBuild = true;
+        if (indexBuilder.joinable()) indexBuilder.join();
+        stopIndexBuild = false;
+    }
+
+    // Верхній об'єкт (останній у порядку малювання), що містить точку
+    Ref<GraphicObject> topLevelAt(int x, int y) {
+        auto index = atomic_load(&hitIndex);
+        if (index && index->generation == sceneGeneration) {
+            index->tree->query(x, y, hitCandidates);
+            hitCandidates.insert(hitCandidates.end(), hitMoved.begin(), hitMoved.end());
+            for (size_t i = hitCount; i < objects.size(); ++i) hitCandidates.push_back((uint32_t)i);
+            sort(hitCandidates.begin(), hitCandidates.end(), greater<uint32_t>());
+            for (uint32_t i : hitCandidates)
+                if (objects[i]->containsPoint(x, y)) return objects[i];
+            return nullptr;
+        }
+        startHitIndexBuild();
+        for (auto it = objects.rbegin(); it != objects.rend(); ++it)
+            if ((*it)->containsPoint(x, y)) return *it;
+        return nullptr;
+    }
+
+    // Позиції об'єктів верхнього рівня, межі яких перетинають region, у порядку малювання
+    void topLevelIn(const BBox& region, vector<uint32_t>& out) const {
+        auto index = atomic_load(&hitIndex);
+        if (index && index->generation == sceneGeneration) {
+            index->tree->query(region, out);
+            out.insert(out.end(), hitMoved.begin(), hitMoved.end());
+            for (size_t i = hitCount; i < objects.size(); ++i) out.push_back((uint32_t)i);
+            sort(out.begin(), out.end());
+            out.erase(unique(out.begin(), out.end()), out.end());
+            // Межі поправок у знімку застаріли або їх там немає
+            out.erase(remove_if(out.begin(), out.end(), [&](uint32_t i) {
+                          return (i >= hitCount || binary_search(hitMoved.begin(), hitMoved.end(), i)) &&
+                                 !objects[i]->bounds().intersects(region);
+                      }), out.end());
+            return;
+        }
+        out.clear();
+        for (uint32_t i = 0; i < objects.size(); ++i)
+            if (objects[i]->bounds().intersects(region)) out.push_back(i);
+    }
+
+    void resetJournal(bool knownBase) {
+        journal = SceneDelta();
+        journal.baseHash = knownBase ? hash() : 0;
+    }
+
+    // Знаходить об'єкт за шляхом ID; ancestors — групи на шляху, index — позиція
+    // серед дітей батька (для верхнього рівня — у objects), ox, oy — світовий зсув батька.
+    // hint — очікувана позиція: якщо збігається, пошук серед сусідів не потрібен;
+    // noIndex — позиція не потрібна (для верхнього рівня не шукається)
+    static constexpr size_t noIndex = SIZE_MAX;
+    Ref<GraphicObject> resolve(const vector<int>& path, size_t hint, vector<Ref<Group>>& ancestors, size_t& index,
+                               int& ox, int& oy) {
+        auto missing = [](int id) { return runtime_error("Об'єкт з ID " + to_string(id) + " не знайдено"); };
+        auto it = topLevel.find(path[0]);
+        if (it == topLevel.end()) throw missing(path[0]);
+        Ref<GraphicObject> cur(it->second);
+        ancestors.clear();
+        ox = oy = 0;
+        index = 0;
+        if (path.size() == 1 && hint != noIndex) {
+            if (hint < objects.size() && objects[hint] == cur) index = hint;
+            else index = (size_t)(find(objects.begin(), objects.end(), cur) - objects.begin());
+        }
+        for (size_t k = 1; k < path.size(); ++k) {
+            auto grp = refCast<Group>(cur);
+            if (!grp) throw missing(path[k]);
+            ancestors.push_back(grp);
+            ox += grp->getX();
+            oy += grp->getY();
+            auto& children = grp->getChildren();
+            size_t i = 0;
+            if (k + 1 == path.size() && hint < children.size() && children[hint]->getId() == path[k]) i = hint;
+            while (i < children.size() && children[i]->getId() != path[k]) ++i;
+            if (i == children.size()) throw missing(path[k]);
+            index = i;
+            cur = children[i];
+        }
+        return cur;
+    }
+
+    // Застосовує операцію дельти й повертає зворотну до неї. Усі перевірки
+    // виконуються до зміни сцени, тож операція з помилкою нічого не змінює.
+    // Репліка отримує ту саму операцію; її елементи теж шукаються заздалегідь.
+    SceneDelta::Operation applyOperation(const SceneDelta::Operation& op) {
+        vector<Ref<Group>> ancestors;
+        size_t index;
+        int ox, oy;
+        SceneDelta::Operation inverse;
+        if (op.op == SceneDelta::Add) {
+            inverse.op = SceneDelta::Remove;
+            inverse.path = op.path;
+            inverse.path.push_back(op.obj->getId());
+            inverse.index = op.index;
+            if (op.path.empty()) {
+                if (op.index > objects.size()) throw runtime_error("Пошкоджені дані: позиція поза межами");
+                uint64_t after = replica && op.index ? elementOf.at(objects[op.index - 1]->getId()) : 0;
+                objects.insert(objects.begin() + op.index, op.obj);
+                if (replica) replica->insert(0, after, *op.obj, &elementOf);
+                topLevel[op.obj->getId()] = op.obj.get();
+                totals += op.obj->stats();
+                if (pager.getBudget())
+                    if (auto grp = refCast<Group>(op.obj)) pager.track(grp);
+                events.publish({SceneEvent::Added, op.obj->getId(), op.obj->getId(), op.obj->bounds()});
+                return inverse;
+            }
+            auto parent = refCast<Group>(resolve(op.path, noIndex, ancestors, index, ox, oy));
+            if (!parent || op.index > parent->getChildren().size())
+                throw runtime_error("Пошкоджені дані: позиція поза межами");
+            uint64_t container = replica ? elementOf.at(parent->getId()) : 0;
+            uint64_t after = replica && op.index ? elementOf.at(parent->getChildren()[op.index - 1]->getId()) : 0;
+            parent->insert(op.index, op.obj);
+            if (replica) replica->insert(container, after, *op.obj, &elementOf);
+            totals += op.obj->stats();
+            BBox dirty = op.obj->bounds().translated(ox + parent->getX(), oy + parent->getY());
+            events.publish({SceneEvent::Added, op.obj->getId(), op.path[0], dirty});
+            return inverse;
+        }
+        auto obj = resolve(op.path, op.op == SceneDelta::Move ? noIndex : op.index, ancestors, index, ox, oy);
+        const BBox old = obj->bounds().translated(ox, oy);
+        BBox dirty = old;
+        SceneEvent::Kind kind = SceneEvent::Removed;
+        uint64_t elem = 0, container = 0, after = 0;
+        if (replica) {
+            elem = elementOf.at(obj->getId());
+            if (op.op == SceneDelta::Replace && ancestors.empty()) {
+                if (index) after = elementOf.at(objects[index - 1]->getId());
+            } else if (op.op == SceneDelta::Replace) {
+                container = elementOf.at(ancestors.back()->getId());
+                if (index) after = elementOf.at(ancestors.back()->getChildren()[index - 1]->getId());
+            }
+        }
+        inverse.op = op.op;
+        inverse.path = op.path;
+        inverse.index = index;
+        if (op.op == SceneDelta::Move) {
+            obj->move(op.dx, op.dy);
+            dirty.expand(obj->bounds().translated(ox, oy));
+            kind = SceneEvent::Moved;
+            inverse.dx = -op.dx;
+            inverse.dy = -op.dy;
+            if (replica) replica->move(elem, obj->getX(), obj->getY());
+        } else if (ancestors.empty()) {
+            topLevel.erase(obj->getId());
+            pager.untrack(obj->getId());
+            if (op.op == SceneDelta::Remove) {
+                objects.erase(objects.begin() + index);
+            } else {
+                objects[index] = op.obj;
+                topLevel[op.obj->getId()] = op.obj.get();
+                if (pager.getBudget())
+                    if (auto grp = refCast<Group>(op.obj)) pager.track(grp);
+            }
+        } else {
+            ancestors.back()->remove(index);
+            if (op.op == SceneDelta::Replace) ancestors.back()->insert(index, op.obj);
+        }
+        if (replica && op.op != SceneDelta::Move) {
+            replica->remove(elem);
+            if (op.op == SceneDelta::Replace) replica->insert(container, after, *op.obj, &elementOf);
+        }
+        if (op.op == SceneDelta::Remove) {
+            inverse.op = SceneDelta::Add;
+            inverse.path.pop_back();
+            inverse.obj = obj;
+        }
+        if (op.op != SceneDelta::Move) totals -= obj->stats();
+        if (op.op == SceneDelta::Replace) {
+            inverse.path.back() = op.obj->getId();
+            inverse.obj = obj;
+            totals += op.obj->stats();
+            dirty.expand(op.obj->bounds().translated(ox, oy));
+            // Межі старого об'єкта: підписник з фільтром області має побачити його видалення
+            if (op.obj->getId() != obj->getId())
+                events.publish({SceneEvent::Removed, obj->getId(), op.path[0], old});
+            int root = ancestors.empty() ? op.obj->getId() : op.path[0];
+            events.publish({SceneEvent::Replaced, op.obj->getId(), root, dirty});
+            return inverse;
+        }
+        events.publish({kind, obj->getId(), op.path[0], dirty});
+        return inverse;
+    }
+
+    void run(shared_ptr<Command> cmd) {
+        cmd->execute();
+        undoStack.push(cmd);
+        while (!redoStack.empty()) redoStack.pop();
+        applied(*cmd, false);
+        pager.enforceBudget();
+    }
+
+    // Пошук найглибшого об'єкта разом зі шляхом груп-предків до нього
+    Ref<GraphicObject> locate(int x, int y, vector<Ref<Group>>& path) {
+        path.clear();
+        Ref<GraphicObject> cur = topLevelAt(x, y);
+        int ox = 0, oy = 0;
+        while (auto grp = refCast<Group>(cur)) {
+            int gx = ox + grp->getX(), gy = oy + grp->getY();
+            Ref<GraphicObject> next;
+            auto& children = grp->getChildren();
+            for (auto c = children.rbegin(); c != children.rend(); ++c) {
+                if ((*c)->containsPoint(x - gx, y - gy)) { next = *c; break; }
+            }
+            if (!next) break;
+            path.push_back(grp);
+            ox = gx; oy = gy;
+            cur = next;
+        }
+        return cur;
+    }
+
+    // Область перегляду або, якщо її не задано, межі всієї сцени
+    BBox visibleArea() const {
+        return viewport.empty() ? sceneBounds() : viewport;
+    }
 public:
-    Circle(int x, int y, int r) : GraphicObject(x, y), radius(r) {}
-    void draw(ostream& os, int indent = 0) const override {
-        os << string(indent, '+') << "Circle (" << x << ", " << y << ") R=" << radius << "\n";
+    // Кількість об'єктів верхнього рівня, з якої пошук за координатами йде через індекс
+    static constexpr size_t hitIndexThreshold = 4096;
+
+    EditorFacade() {
+        resetJournal(true);
+        // Растрові кеші й ID-буфер оновлюються за сумарною областю пакета змін
+        events.subscribe(SceneEvent::All, [this](const vector<SceneEvent>& batch, const BBox& dirty) {
+            noteHitChanges(batch);
+            if (any_of(batch.begin(), batch.end(), [](const SceneEvent& e) { return e.kind == SceneEvent::Reset; }))
+                pick.invalidate();
+            onDamage(dirty);
+        });
     }
-    bool containsPoint(int px, int py) const override {
-        int dx = px - x, dy = py - y;
-        return dx*dx + dy*dy <= radius*radius;
+    ~EditorFacade() {
+        stopHitIndexBuild();
+        waitBackgroundSave();
     }
-    shared_ptr<GraphicObject> clone() const override {
-        return make_shared<Circle>(*this);
+
+    void addObject(Ref<GraphicObject> obj) {
+        run(make_shared<AddCommand>(objects, obj));
     }
-};
 
-// Прямокутник
-class Rectangle : public GraphicObject {
-    int width, height;
-public:
-    Rectangle(int x, int y, int w, int h) : GraphicObject(x, y), width(w), height(h) {}
-    void draw(ostream& os, int indent = 0) const override {
-        os << string(indent, '+') << "Rectangle (" << x << ", " << y << ") " << width << "*" << height << "\n";
+    // Заморожує групи верхнього рівня; повертає кількість замороджених,
+    // пропущені — ті, на нащадків яких посилаються історія команд чи ID-буфер
+    size_t freezeGroups(size_t& skipped, size_t& bytesBefore, size_t& bytesAfter) {
+        size_t count = 0;
+        skipped = bytesBefore = bytesAfter = 0;
+        for (auto& obj : objects) {
+            auto grp = shapeCast<Group>(obj.get());
+            if (!grp || grp->isFrozen()) continue;
+            size_t before = residentBytes(*grp);
+            if (!grp->freeze()) { ++skipped; continue; }
+            bytesBefore += before;
+            bytesAfter += residentBytes(*grp);
+            ++count;
+        }
+        return count;
     }
-    bool containsPoint(int px, int py) const override {
-        return (px >= x && px <= x + width && py >= y && py <= y + height);
+
+    // Додає всі об'єкти статичного шаблону окремими командами
+    template <size_t N>
+    void addTemplate(const StaticScene<N>& scene) {
+        SceneEventBus::Batch batch(events);
+        for (auto& obj : scene.instantiate())
+            addObject(obj);
     }
-    shared_ptr<GraphicObject> clone() const override {
-        return make_shared<Rectangle>(*this);
+
+    // Переміщує найглибший об'єкт у точці (x, y); false — об'єкта немає
+    bool moveElementAt(int x, int y, int dx, int dy) {
+        vector<Ref<Group>> path;
+        auto obj = locate(x, y, path);
+        if (!obj) return false;
+        run(make_shared<MoveCommand>(obj, path, dx, dy));
+        return true;
     }
-};
 
-// Група (Composite)
-class Group : public GraphicObject, public enable_shared_from_this<Group> {
-    vector<shared_ptr<GraphicObject>> children;
-public:
-    Group(int x = 0, int y = 0) : GraphicObject(x, y) {}
+    // Бюджет пам'яті для груп верхнього рівня; 0 — підкачку вимкнено
+    // (витіснені групи підвантажаться при наступному зверненні)
+    void setPagingBudget(size_t bytes) {
+        bool wasOff = pager.getBudget() == 0;
+        pager.setBudget(bytes);
+        if (bytes == 0) return;
+        if (wasOff)
+            for (auto& obj : objects)
+                if (auto grp = refCast<Group>(obj)) pager.track(grp);
+        pager.enforceBudget();
+    }
+    PageManager& getPager() { return pager; }
+    // Підписка на зміни сцени: сповіщення надходять після кожної операції редактора
+    SceneEventBus& getEvents() { return events; }
+    // Точка між операціями, де можна витісняти групи на диск
+    void enforceMemoryBudget() { pager.enforceBudget(); }
 
-    void add(shared_ptr<GraphicObject> obj) {
-        children.push_back(obj);
+    // Зберігає сцену у файл; у той самий файл, що й минулого разу, дописуються
+    // лише змінені об'єкти. false — помилка (повідомлення виведено)
+    bool saveScene(const string& path) {
+        waitBackgroundSave();
+        try {
+            if (path == scenePath)
+                lastSave = SceneFile::update(path, objects, savedChunks);
+            else
+                lastSave = SceneFile::save(path, objects, &savedChunks);
+            scenePath = path;
+        } catch (const exception& e) {
+            cout << e.what() << "\n";
+            return false;
+        }
+        return true;
     }
+    const SceneFile::SaveStats& lastSaveStats() const { return lastSave; }
 
-    void draw(ostream& os, int indent = 0) const override {
-        os << string(indent, '+') << "Group (" << x << ", " << y << ")\n";
-        for (auto& child : children)
-            child->draw(os, indent + 1);
+    uint64_t hash() const { return sceneHash(objects); }
+
+    // Показники всієї сцени; підтримуються при кожній зміні, без обходу
+    const SubtreeStats& sceneStats() const { return totals; }
+
+    // Довгі операції порціями (див. Job); сцену між кроками змінювати не можна.
+    // Запис у новий файл іде через Writer; у той самий — дозапис за один крок.
+    unique_ptr<Job> saveSceneJob(const string& path) {
+        waitBackgroundSave();
+        if (path == scenePath) {
+            struct Update : Job {
+                EditorFacade& editor;
+                string path;
+                Update(EditorFacade& editor, const string& path) : editor(editor), path(path) {}
+                bool step() override { return false; }
+                double progress() const override { return 1.0; }
+                bool finish() override { return editor.saveScene(path); }
+            };
+            return unique_ptr<Job>(new Update(*this, path));
+        }
+        try {
+            return unique_ptr<Job>(new SaveJob(path, objects,
+                [this, path](const SceneFile::SaveStats& stats, SceneFile::ChunkIndex& index) {
+                    lastSave = stats;
+                    savedChunks = std::move(index);
+                    scenePath = path;
+                }));
+        } catch (const exception& e) {
+            cout << e.what() << "\n";
+            return nullptr;
+        }
+    }
+    // nullptr — завеликий растр чи невірний рівень суперсемплінгу (повідомлення виведено)
+    unique_ptr<Job> exportJob(const string& path, double scale, int supersample) const {
+        if (supersample != 1 && supersample != 2 && supersample != 4) {
+            cout << "Рівень суперсемплінгу має бути 1, 2 або 4.\n";
+            return nullptr;
+        }
+        BBox world = visibleArea();
+        if (world.empty()) world = BBox(0, 0, 0, 0);
+        RasterView view = RasterView::fit(world, scale);
+        if (!ExportJob::fits(view)) {
+            cout << "Растр " << view.width << "x" << view.height << " завеликий для експорту (до "
+                 << ExportJob::maxPixels << " пікселів, сторона до " << ExportJob::maxSide << ").\n";
+            return nullptr;
+        }
+        return unique_ptr<Job>(new ExportJob(objects, view, supersample, path));
+    }
+    // nullptr — помилка в запиті (повідомлення виведено)
+    unique_ptr<Job> selectJob(const string& query, vector<SceneQuery::Match>& matches) const {
+        try {
+            return unique_ptr<Job>(new QueryJob(SceneQuery::compile(query), objects, matches));
+        } catch (const exception& e) {
+            cout << e.what() << "\n";
+            return nullptr;
+        }
+    }
+    // Копія всієї сцени зі зсувом однією групою: один undo її прибирає
+    unique_ptr<Job> cloneSceneJob(int dx, int dy) {
+        return unique_ptr<Job>(new CloneJob(objects, dx, dy, (size_t)totals.count(),
+                                            [this](Ref<GraphicObject> copy) { addObject(copy); }));
     }
 
-    bool containsPoint(int px, int py) const override {
-        for (auto it = children.rbegin(); it != children.rend(); ++it) {
-            if ((*it)->containsPoint(px - x, py - y))
-                return true;
+    // Найглибша група, що містить точку (x, y): показники її нащадків і межі у світових
+    // координатах; false — точка поза групами
+    bool groupStatsAt(int x, int y, SubtreeStats& stats, BBox& bounds) {
+        vector<Ref<Group>> path;
+        auto obj = locate(x, y, path);
+        if (!obj) return false;
+        if (auto grp = refCast<Group>(obj)) path.push_back(grp);
+        if (path.empty()) return false;
+        int ox = 0, oy = 0;
+        for (size_t i = 0; i + 1 < path.size(); ++i) { ox += path[i]->getX(); oy += path[i]->getY(); }
+        stats = path.back()->descendantStats();
+        bounds = path.back()->bounds().translated(ox, oy);
+        return true;
+    }
+
+    // Відмінності від сцени у файлі (файл — стара версія); false — файл не прочитано.
+    // Файл відкривається ліниво: групи з хешем із заголовка, що збігається з
+    // поточним, не читаються з диска, тож час залежить від обсягу змін
+    bool diffWithFile(const string& path, vector<SceneChange>& changes, size_t& visited) const {
+        try {
+            changes = diffScenes(SceneFile::load(path, true), objects, &visited);
+        } catch (const exception& e) {
+            cout << e.what() << "\n";
+            return false;
         }
-        return false;
+        return true;
     }
 
-    shared_ptr<GraphicObject> findDeepest(int px, int py) {
-        for (auto it = children.rbegin(); it != children.rend(); ++it) {
-            if ((*it)->containsPoint(px - x, py - y)) {
-                auto grp = dynamic_pointer_cast<Group>(*it);
-                if (grp) return grp->findDeepest(px - x, py - y);
-                else return *it;
+    // Дельта змін після попередньої виданої (або з моменту завантаження)
+    vector<uint8_t> takeDelta() {
+        if (journal.baseHash) journal.targetHash = hash();
+        vector<uint8_t> bytes = journal.encode();
+        uint64_t next = journal.targetHash;
+        journal = SceneDelta();
+        journal.baseHash = next;
+        return bytes;
+    }
+
+    // Дельта від сцени у файлі до поточної; false — файл не прочитано
+    bool deltaFromFile(const string& path, vector<uint8_t>& bytes) const {
+        try {
+            bytes = SceneDelta::between(SceneFile::load(path, false), objects).encode();
+        } catch (const exception& e) {
+            cout << e.what() << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Застосовує дельту за ID об'єктів; час пропорційний кількості операцій і
+    // глибині шляхів (позиції записані в операціях, тож сусідів не шукаємо).
+    // verify — звірити хеші базової й цільової версії: два проходи сценою, тож
+    // для частих малих дельт його вимикають. Без перевірки цільовий хеш дельти
+    // стає базою журналу, лише якщо сцена не змінювалася після попередньої бази.
+    // Дельта застосовується цілком або ніяк: після помилки виконані операції
+    // скасовуються зворотними. Історію дій очищено: команди посилаються на старі об'єкти.
+    bool applyDelta(const vector<uint8_t>& bytes, size_t& applied, bool verify = true) {
+        applied = 0;
+        vector<SceneDelta::Operation> operations;
+        SceneDelta delta;
+        try {
+            delta = SceneDelta::decode(bytes);
+            delta.forEach([&](const SceneDelta::Operation& op) { operations.push_back(op); });
+        } catch (const exception& e) {
+            cout << e.what() << "\n";
+            return false;
+        }
+        if (verify && delta.baseHash && journal.baseHash != 0 && hash() != delta.baseHash) {
+            cout << "Дельта створена для іншої версії сцени.\n";
+            return false;
+        }
+        bool known = delta.targetHash && journal.baseHash != 0 &&
+                     (verify || (journal.size() == 0 && delta.baseHash == journal.baseHash));
+        {
+            // Уся дельта — один пакет сповіщень, разом зі скасуванням після помилки
+            SceneEventBus::Batch batch(events);
+            vector<SceneDelta::Operation> inverses;
+            inverses.reserve(operations.size());
+            bool ok = true;
+            try {
+                for (auto& op : operations) inverses.push_back(applyOperation(op));
+            } catch (const exception& e) {
+                cout << e.what() << "\n";
+                ok = false;
+            }
+            if (ok && verify && known && hash() != delta.targetHash) {
+                cout << "Після застосування сцена не збігається з цільовою версією.\n";
+                ok = false;
+            }
+            if (!ok) {
+                for (auto it = inverses.rbegin(); it != inverses.rend(); ++it) applyOperation(*it);
+                cout << "Дельту не застосовано, сцену не змінено.\n";
+                return false;
             }
         }
-        return shared_from_this();
+        applied = operations.size();
+        while (!undoStack.empty()) undoStack.pop();
+        while (!redoStack.empty()) redoStack.pop();
+        // Цільовий хеш уже звірено (або дельті довіряють): сцену не хешуємо втретє
+        journal = SceneDelta();
+        journal.baseHash = known ? delta.targetHash : 0;
+        return true;
     }
 
-    shared_ptr<GraphicObject> clone() const override {
-        auto newGroup = make_shared<Group>(x, y);
-        for (auto& child : children)
-            newGroup->add(child->clone());
-        return newGroup;
+    // Збереження без паузи: знімок сцени пише окремий процес, редагування триває.
+    // Без fork (не POSIX) зберігає одразу. false — не вдалося запустити.
+    bool saveSceneInBackground(const string& path) {
+#ifdef LB5_HAVE_FORK
+        waitBackgroundSave();
+        int fds[2];
+        if (pipe(fds) != 0) {
+            cout << "Не вдалося створити канал для фонового збереження.\n";
+            return false;
+        }
+        cout.flush();
+        // Дочірній процес успадкує лише потік, що викликав fork: потоки побудови
+        // індексу не мають тримати блокування аллокатора чи інші на цей момент
+        stopHitIndexBuild();
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            backgroundSaveChild(path, fds[1]);
+        }
+        startHitIndexBuild();
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            cout << "Не вдалося запустити фонове збереження.\n";
+            return false;
+        }
+        close(fds[1]);
+        background.reset(new BackgroundSave);
+        background->pid = pid;
+        background->channel = fds[0];
+        background->path = path;
+        background->total = objects.size();
+        return true;
+#else
+        return saveScene(path);
+#endif
     }
 
-    vector<shared_ptr<GraphicObject>>& getChildren() { return children; }
-};
+    // Перевіряє стан фонового збереження; true — ще триває
+    bool pollBackgroundSave() {
+#ifdef LB5_HAVE_FORK
+        collectBackgroundSave(false);
+        return background != nullptr;
+#else
+        return false;
+#endif
+    }
+    void waitBackgroundSave() {
+#ifdef LB5_HAVE_FORK
+        collectBackgroundSave(true);
+#endif
+    }
+    // Готово відсотків (0, якщо збереження не триває)
+    int backgroundSaveProgress() const {
+#ifdef LB5_HAVE_FORK
+        if (background && background->total) return (int)(background->done * 100 / background->total);
+#endif
+        return 0;
+    }
 
-// Команди (Command pattern)
-class Command {
-public:
-    virtual void execute() = 0;
-    virtual void undo() = 0;
-    virtual ~Command() = default;
-};
+    // Замінює сцену вмістом файлу й очищує історію; lazy — діти груп
+    // читаються з файлу лише при першому обході
+    bool loadScene(const string& path, bool lazy) {
+        waitBackgroundSave();
+        vector<Ref<GraphicObject>> loaded;
+        try {
+            loaded = SceneFile::load(path, lazy, 0, &savedChunks);
+        } catch (const exception& e) {
+            cout << e.what() << "\n";
+            return false;
+        }
+        scenePath = path;
+        // Хеш лінивої сцени розпакував би її цілком, тож базу дельти не перевіряємо
+        replaceScene(std::move(loaded), !lazy);
+        resyncReplica();
+        return true;
+    }
 
-class AddCommand : public Command {
-    vector<shared_ptr<GraphicObject>>& objects;
-    shared_ptr<GraphicObject> obj;
-public:
-    AddCommand(vector<shared_ptr<GraphicObject>>& objs, shared_ptr<GraphicObject> obj)
-        : objects(objs), obj(obj) {}
-    void execute() override { objects.push_back(obj); }
-    void undo() override { if(!objects.empty()) objects.pop_back(); }
-};
+    // Вмикає спільне редагування: поточна сцена стає початковим станом репліки
+    void startReplication() {
+        if (replica) return;
+        replica.reset(new ReplicatedScene(nextReplicaId()));
+        resyncReplica();
+    }
+    uint32_t replicaId() const { return replica ? replica->getReplica() : 0; }
 
-// Фасад
-class EditorFacade {
-    vector<shared_ptr<GraphicObject>> objects;
-    stack<shared_ptr<Command>> undoStack, redoStack;
-public:
-    void addObject(shared_ptr<GraphicObject> obj) {
-        auto cmd = make_shared<AddCommand>(objects, obj);
-        cmd->execute();
-        undoStack.push(cmd);
-        while (!redoStack.empty()) redoStack.pop();
+    // Стає новою копією сцени peer: власна сцена замінюється спільним станом
+    void joinReplication(EditorFacade& peer) {
+        peer.startReplication();
+        replica.reset(new ReplicatedScene(nextReplicaId()));
+        replica->merge(*peer.replica);
+        elementOf.clear();
+        replaceScene(replica->materialize(&elementOf), true);
+    }
+
+    // Зливає операції копії peer, яких тут ще немає; якщо такі були, сцена
+    // замінюється злитим станом, а історія дій очищується. Повертає кількість операцій.
+    size_t syncWith(const EditorFacade& peer) {
+        if (!replica || !peer.replica) return 0;
+        size_t merged = replica->merge(*peer.replica);
+        if (merged) {
+            elementOf.clear();
+            replaceScene(replica->materialize(&elementOf), true);
+        }
+        return merged;
+    }
+
+    void setPickMode(bool on) {
+        pickMode = on;
+        if (!on) { pick.invalidate(); return; }
+        if (!pick.rebuild(objects)) {
+            pickMode = false;
+            cout << "Сцена завелика для ID-буфера.\n";
+        }
     }
+    bool isPickMode() const { return pickMode; }
+
+    void setViewport(const BBox& view) { viewport = view; }
+    void clearViewport() { viewport = BBox(); }
+    const BBox& getViewport() const { return viewport; }
+
+    // Растр області view; порожня view — область перегляду
+    Framebuffer render(BBox view = BBox()) {
+        if (view.empty()) view = visibleArea();
+        return tiles.render(objects, view);
+    }
+    size_t lastRenderedTiles() const { return tiles.lastRasterizedCount(); }
+
+    // Огляд сцени: кожен піксель покриває 2^level світових одиниць
+    Framebuffer renderLod(int level, BBox view = BBox()) {
+        if (view.empty()) view = visibleArea();
+        return lod.render(objects, view, level);
+    }
+    size_t lastRenderedLodTiles() const { return lod.lastRasterizedCount(); }
 
     void undo() {
         if (!undoStack.empty()) {
             auto cmd = undoStack.top(); undoStack.pop();
             cmd->undo();
             redoStack.push(cmd);
+            applied(*cmd, true);
         } else {
             cout << "Немає дій для скасування.\n";
         }
@@ -146,6 +4734,8 @@ public:
             auto cmd = redoStack.top(); redoStack.pop();
             cmd->execute();
             undoStack.push(cmd);
+            applied(*cmd, false);
+            pager.enforceBudget();
         } else {
             cout << "Немає дій для повторення.\n";
         }
@@ -156,19 +4746,46 @@ public:
             cout << "[Порожньо]\n";
             return;
         }
-        for (auto& obj : objects)
-            obj->draw(cout);
+        if (viewport.empty()) {
+            for (auto& obj : objects)
+                obj->draw(cout);
+            return;
+        }
+        vector<uint32_t> visible;
+        topLevelIn(viewport, visible);
+        for (uint32_t i : visible) {
+            const Ref<GraphicObject>& obj = objects[i];
+            if (auto grp = shapeCast<Group>(obj.get()))
+                grp->drawInView(cout, viewport, 0, 0);
+            else
+                obj->draw(cout);
+        }
+        if (visible.empty()) cout << "[В області перегляду порожньо]\n";
     }
 
-    shared_ptr<GraphicObject> findElementAt(int x, int y) {
-        for (auto it = objects.rbegin(); it != objects.rend(); ++it) {
-            if ((*it)->containsPoint(x, y)) {
-                auto grp = dynamic_pointer_cast<Group>(*it);
-                if (grp) return grp->findDeepest(x, y);
-                else return *it;
-            }
-        }
-        return nullptr;
+    Ref<GraphicObject> findElementAt(int x, int y) {
+        if (pickMode) return pick.lookup(x, y);
+        auto obj = topLevelAt(x, y);
+        if (auto grp = refCast<Group>(obj)) return grp->findDeepest(x, y);
+        return obj;
+    }
+    // Індекс пошуку за координатами побудовано для поточної сцени
+    bool hitIndexReady() const {
+        auto index = atomic_load(&hitIndex);
+        return index && index->generation == sceneGeneration;
+    }
+    // Назва готового індексу; nullptr — пошук поки що переглядає список
+    const char* hitIndexName() const {
+        auto index = atomic_load(&hitIndex);
+        return index && index->generation == sceneGeneration ? index->tree->name() : nullptr;
+    }
+    SpatialIndexKind getSpatialIndexKind() const { return indexKind; }
+    // Інший тип індексу: поточний відкидається й будується заново
+    void setSpatialIndexKind(SpatialIndexKind kind) {
+        stopHitIndexBuild();
+        indexKind = kind;
+        atomic_store(&hitIndex, shared_ptr<const HitIndex>());
+        startHitIndexBuild();
     }
 };
 
@@ -187,17 +4804,17 @@ int readInt(const string& prompt) {
 }
 
 // Створення кола
-shared_ptr<GraphicObject> createCircle() {
+Ref<GraphicObject> createCircle() {
     int x = readInt("Введіть X центру кола: ");
     int y = readInt("Введіть Y центру кола: ");
     int r;
     while ((r = readInt("Введіть радіус кола (>0): ")) <= 0)
         cout << "Радіус має бути додатнім числом.\n";
-    return make_shared<Circle>(x, y, r);
+    return makeRef<Circle>(x, y, r);
 }
 
 // Створення прямокутника
-shared_ptr<GraphicObject> createRectangle() {
+Ref<GraphicObject> createRectangle() {
     int x = readInt("Введіть X лівого верхнього кута: ");
     int y = readInt("Введіть Y лівого верхнього кута: ");
     int w;
@@ -206,14 +4823,14 @@ shared_ptr<GraphicObject> createRectangle() {
     int h;
     while ((h = readInt("Введіть висоту (>0): ")) <= 0)
         cout << "Висота має бути додатнім числом.\n";
-    return make_shared<Rectangle>(x, y, w, h);
+    return makeRef<Rectangle>(x, y, w, h);
 }
 
 // Рекурсивне створення групи
-shared_ptr<Group> createGroup() {
+Ref<Group> createGroup() {
     int x = readInt("Введіть X позицію групи: ");
     int y = readInt("Введіть Y позицію групи: ");
-    auto group = make_shared<Group>(x, y);
+    auto group = makeRef<Group>(x, y);
 
     cout << "Додаємо об'єкти до групи. Введіть кількість об'єктів: ";
     int count = readInt("");
@@ -224,7 +4841,7 @@ shared_ptr<Group> createGroup() {
         cin >> choice;
         cin.ignore(); // зняти \n після числа
 
-        shared_ptr<GraphicObject> obj = nullptr;
+        Ref<GraphicObject> obj = nullptr;
         if (choice == 1) obj = createCircle();
         else if (choice == 2) obj = createRectangle();
         else if (choice == 3) obj = createGroup();
@@ -237,10 +4854,441 @@ shared_ptr<Group> createGroup() {
     return group;
 }
 
+// Генерація випадкової сцени для бенчмарків: кола, прямокутники та вкладені групи
+vector<Ref<GraphicObject>> generateScene(int count, int worldSize, unsigned seed) {
+    mt19937 rng(seed);
+    auto rnd = [&](int n) { return (int)(rng() % (unsigned)n); };
+    function<Ref<GraphicObject>(int, int)> make = [&](int depth, int extent) -> Ref<GraphicObject> {
+        int kind = rnd(depth < 3 ? 10 : 9);
+        if (kind < 5) return makeRef<Circle>(rnd(extent), rnd(extent), 1 + rnd(8));
+        if (kind < 9) return makeRef<Rectangle>(rnd(extent), rnd(extent), 1 + rnd(12), 1 + rnd(12));
+        auto grp = makeRef<Group>(rnd(extent), rnd(extent));
+        int n = 1 + rnd(6);
+        for (int i = 0; i < n; ++i) grp->add(make(depth + 1, 40));
+        return grp;
+    };
+    vector<Ref<GraphicObject>> objects;
+    for (int i = 0; i < count; ++i) objects.push_back(make(0, worldSize));
+    return objects;
+}
+
+template <class F>
+double measureSeconds(F&& f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Порівняння точкової растеризації та згладженої (скалярної і SIMD)
+void benchmarkRasterization() {
+    auto objects = generateScene(20000, 1024, 42);
+    RasterView view = RasterView::fit(BBox(0, 0, 1023, 1023), 1.0);
+    double mpix = view.width * (double)view.height / 1e6;
+    auto report = [&](const string& name, double sec) {
+        cout << name << ": " << sec * 1000 << " мс, " << mpix / sec << " Мпікс/с\n";
+    };
+    report("Без згладжування", measureSeconds([&] { CoverageRasterizer::renderAliased(objects, view); }));
+    report("Згладжування, скалярно", measureSeconds([&] { CoverageRasterizer::render(objects, view, 1, false); }));
+    report("Згладжування, SIMD", measureSeconds([&] { CoverageRasterizer::render(objects, view, 1, true); }));
+    report("Згладжування, SIMD, 2x2", measureSeconds([&] { CoverageRasterizer::render(objects, view, 2, true); }));
+    report("Згладжування, SIMD, 4x4", measureSeconds([&] { CoverageRasterizer::render(objects, view, 4, true); }));
+}
+
+// Рендер великої сцени у віддаленому масштабі: повна растеризація проти
+// рівнів деталізації (перший кадр, повтор із кешу, кадр після зміни)
+void benchmarkLod() {
+    auto objects = generateScene(200000, 16384, 7);
+    BBox world(0, 0, 16383, 16383);
+    const int level = 6;
+    LodRenderer lod;
+    cout << "Об'єктів верхнього рівня: " << objects.size() << ", рівень " << level << "\n";
+    cout << "Повна растеризація: " << measureSeconds([&] {
+        CoverageRasterizer::render(objects, RasterView::fit(world, 1.0 / (1 << level)));
+    }) * 1000 << " мс\n";
+    cout << "LOD, перший кадр: " << measureSeconds([&] { lod.render(objects, world, level); }) * 1000 << " мс\n";
+    cout << "LOD, повтор: " << measureSeconds([&] { lod.render(objects, world, level); }) * 1000 << " мс\n";
+    BBox before = objects[0]->bounds();
+    objects[0]->move(100, 100);
+    before.expand(objects[0]->bounds());
+    lod.markDamaged(before);
+    cout << "LOD, після переміщення: " << measureSeconds([&] { lod.render(objects, world, level); }) * 1000
+         << " мс (плиток: " << lod.lastRasterizedCount() << ")\n";
+}
+
+// Віртуальна ієрархія на Ref проти значень у std::variant
+void benchmarkVariant() {
+    auto objects = generateScene(100000, 4096, 11);
+    VScene scene;
+    cout << "Перетворення у variant: " << measureSeconds([&] { scene = VScene::from(objects); }) * 1000 << " мс\n";
+
+    mt19937 rng(5);
+    vector<pair<int, int>> points(200);
+    for (auto& p : points) p = {(int)(rng() % 4096), (int)(rng() % 4096)};
+    size_t hitsV = 0, hitsS = 0;
+    double tv = measureSeconds([&] {
+        for (auto& p : points) hitsV += hitTest(objects, p.first, p.second) != nullptr;
+    });
+    double ts = measureSeconds([&] {
+        for (auto& p : points) hitsS += scene.findElementAt(p.first, p.second) != nullptr;
+    });
+    cout << "Пошук за координатами (200 запитів): віртуальні " << tv * 1000 << " мс, variant " << ts * 1000
+         << " мс" << (hitsV == hitsS ? "" : " (РОЗБІЖНІСТЬ!)") << "\n";
+
+    BBox bv, bs;
+    tv = measureSeconds([&] { for (auto& obj : objects) bv.expand(obj->bounds()); });
+    ts = measureSeconds([&] { for (auto& node : scene.objects) bs.expand(bounds(node)); });
+    cout << "Межі сцени: віртуальні " << tv * 1000 << " мс, variant " << ts * 1000 << " мс\n";
+
+    tv = measureSeconds([&] { vector<Ref<GraphicObject>> copy; for (auto& obj : objects) copy.push_back(obj->clone()); });
+    ts = measureSeconds([&] { VScene copy = scene; });
+    cout << "Клонування: віртуальні " << tv * 1000 << " мс, variant " << ts * 1000 << " мс\n";
+
+    ostringstream ov, os;
+    tv = measureSeconds([&] { for (auto& obj : objects) obj->draw(ov); });
+    ts = measureSeconds([&] { for (auto& node : scene.objects) draw(node, os); });
+    cout << "Вивід: віртуальні " << tv * 1000 << " мс, variant " << ts * 1000 << " мс"
+         << (ov.str() == os.str() ? "" : " (РОЗБІЖНІСТЬ!)") << "\n";
+}
+
+// Пам'ять і швидкість дочірніх контейнерів: vector проти SmallVector<_, 8>
+void benchmarkCompactLayout() {
+    cout << "sizeof: Circle " << sizeof(Circle) << ", Rectangle " << sizeof(Rectangle) << ", Group " << sizeof(Group)
+         << " (з них діти " << sizeof(Group::Children) << "), Ref " << sizeof(Ref<GraphicObject>) << " байт\n";
+
+    const int groups = 200000;
+    mt19937 rng(3);
+    vector<int> sizes(groups);
+    for (auto& n : sizes) n = 1 + (int)(rng() % 7);
+    auto shared = makeRef<Circle>(1, 2, 3);
+
+    vector<vector<Ref<GraphicObject>>> vecs(groups);
+    vector<Group::Children> smalls(groups);
+    double tv = measureSeconds([&] {
+        for (int i = 0; i < groups; ++i)
+            for (int k = 0; k < sizes[i]; ++k) vecs[i].push_back(shared);
+    });
+    double ts = measureSeconds([&] {
+        for (int i = 0; i < groups; ++i)
+            for (int k = 0; k < sizes[i]; ++k) smalls[i].push_back(shared);
+    });
+    // Оцінка блоку malloc: заголовок 8 байт, вирівнювання 16, мінімум 32 (як у glibc)
+    auto chunk = [](size_t bytes) { return max<size_t>(32, (bytes + 8 + 15) & ~(size_t)15); };
+    size_t heapVec = 0, heapSmall = 0, allocVec = 0, allocSmall = 0;
+    for (auto& v : vecs) if (v.capacity()) { heapVec += chunk(v.capacity() * sizeof(Ref<GraphicObject>)); ++allocVec; }
+    for (auto& v : smalls) if (v.onHeap()) { heapSmall += chunk(v.capacity() * sizeof(Ref<GraphicObject>)); ++allocSmall; }
+    cout << "Заповнення " << groups << " груп: vector " << tv * 1000 << " мс, SmallVector " << ts * 1000 << " мс\n";
+    cout << "Пам'ять: vector " << (sizeof(vector<Ref<GraphicObject>>) * groups + heapVec) / 1024 << " КБ ("
+         << allocVec << " буферів у купі), SmallVector " << (sizeof(Group::Children) * groups + heapSmall) / 1024
+         << " КБ (" << allocSmall << " буферів у купі)\n";
+
+    long long sumV = 0, sumS = 0;
+    tv = measureSeconds([&] { for (auto& v : vecs) for (auto& r : v) sumV += r->getX(); });
+    ts = measureSeconds([&] { for (auto& v : smalls) for (auto& r : v) sumS += r->getX(); });
+    cout << "Обхід: vector " << tv * 1000 << " мс, SmallVector " << ts * 1000 << " мс"
+         << (sumV == sumS ? "" : " (РОЗБІЖНІСТЬ!)") << "\n";
+
+    auto objects = generateScene(100000, 4096, 11);
+    size_t hits = 0;
+    double th = measureSeconds([&] {
+        for (int i = 0; i < 200; ++i) hits += hitTest(objects, (int)(rng() % 4096), (int)(rng() % 4096)) != nullptr;
+    });
+    cout << "Пошук за координатами у сцені зі 100000 об'єктів: " << 200 / th << " запитів/с\n";
+}
+
+void benchmarkSceneFile() {
+    auto objects = generateScene(300000, 16384, 5);
+    const string path = "lb5_benchmark.lb5";
+    SceneFile::ChunkIndex index;
+    SceneFile::SaveStats stats;
+    cout << "Збереження 300000 об'єктів: " << measureSeconds([&] { stats = SceneFile::save(path, objects, &index); }) * 1000
+         << " мс, " << stats.written / 1024 << " КБ\n";
+    objects[0]->move(1, 1);
+    cout << "Дозапис після зміни одного об'єкта: "
+         << measureSeconds([&] { stats = SceneFile::update(path, objects, index); }) * 1000 << " мс, "
+         << stats.written / 1024 << " КБ\n";
+    auto leaves = [](const vector<Ref<GraphicObject>>& scene) {
+        size_t n = 0;
+        BBox all(INT32_MIN / 2, INT32_MIN / 2, INT32_MAX / 2, INT32_MAX / 2);
+        for (auto& obj : scene) forEachLeaf(obj, 0, 0, all, [&](const Ref<GraphicObject>&, int, int) { ++n; });
+        return n;
+    };
+    vector<Ref<GraphicObject>> loaded;
+    cout << "Ліниве відкриття: " << measureSeconds([&] { loaded = SceneFile::load(path, true); }) * 1000 << " мс\n";
+    cout << "Повне відкриття в 1 потоці: " << measureSeconds([&] { loaded = SceneFile::load(path, false, 1); }) * 1000 << " мс\n";
+    size_t expected = leaves(loaded);
+    cout << "Повне відкриття в " << max(1u, thread::hardware_concurrency()) << " потоках: "
+         << measureSeconds([&] { loaded = SceneFile::load(path, false); }) * 1000 << " мс"
+         << (leaves(loaded) == expected && expected == leaves(objects) ? "" : " (РОЗБІЖНІСТЬ!)") << "\n";
+    remove(path.c_str());
+}
+
+// Копії спершу редагують незалежно (100000 одночасних операцій загалом), потім
+// кожна зливає журнали інших у власному порядку; стани мають збігтися
+void benchmarkReplication() {
+    const int replicas = 4, opsPerReplica = 25000;
+    vector<ReplicatedScene> peers;
+    for (int r = 0; r < replicas; ++r) peers.emplace_back(r + 1);
+
+    // Спільний початок: кілька груп, які всі копії вже бачили
+    for (int i = 0; i < 50; ++i)
+        peers[0].insert(0, peers[0].elements().empty() ? 0 : peers[0].elements().back(), ShapeKind::Group, i * 20, 0);
+    for (int r = 1; r < replicas; ++r) peers[r].merge(peers[0]);
+
+    double local = measureSeconds([&] {
+        for (int r = 0; r < replicas; ++r) {
+            ReplicatedScene& p = peers[r];
+            mt19937 rng(100 + r);
+            for (int i = 0; i < opsPerReplica; ++i) {
+                const auto& ids = p.elements();
+                uint64_t elem = ids[rng() % ids.size()];
+                int op = (int)(rng() % 20);
+                if (op < 10 || p.isRemoved(elem)) {
+                    // Вставка після випадкового елемента в його контейнер або всередину групи
+                    bool inside = p.kindOf(elem) == ShapeKind::Group && op % 2;
+                    uint64_t container = inside ? elem : p.containerOf(elem);
+                    uint64_t after = inside ? 0 : elem;
+                    if (op % 3) p.insert(container, after, ShapeKind::Circle, (int)(rng() % 40), (int)(rng() % 40), 1 + (int)(rng() % 5));
+                    else p.insert(container, after, ShapeKind::Rectangle, (int)(rng() % 40), (int)(rng() % 40), 3, 2);
+                } else if (op < 17) {
+                    p.move(elem, (int)(rng() % 1000), (int)(rng() % 1000));
+                } else {
+                    p.remove(elem);
+                }
+            }
+        }
+    });
+    cout << "Локальні операції: " << replicas * opsPerReplica << " за " << local * 1000 << " мс\n";
+
+    size_t merged = 0;
+    double t = measureSeconds([&] {
+        for (int r = 0; r < replicas; ++r) {
+            vector<int> order;
+            for (int q = 0; q < replicas; ++q)
+                if (q != r) order.push_back(q);
+            shuffle(order.begin(), order.end(), mt19937(r));
+            for (int q : order) merged += peers[r].merge(peers[q]);
+        }
+    });
+    cout << "Злиття: " << merged << " операцій за " << t * 1000 << " мс (" << (size_t)(merged / t) << " операцій/с)\n";
+
+    uint64_t h = sceneHash(peers[0].materialize());
+    bool same = true;
+    for (int r = 1; r < replicas; ++r) same &= sceneHash(peers[r].materialize()) == h;
+    cout << "Стани копій " << (same ? "збігаються" : "РОЗІЙШЛИСЯ!") << " (" << peers[0].materialize().size()
+         << " об'єктів верхнього рівня)\n";
+}
+
+// Запити до великої сцени: один потік проти всіх ядер; повний обхід дерева — для порівняння
+void benchmarkQuery() {
+    auto objects = generateScene(300000, 16384, 9);
+    size_t nodes = 0;
+    function<void(const GraphicObject&)> walk = [&](const GraphicObject& obj) {
+        ++nodes;
+        if (auto grp = shapeCast<Group>(&obj))
+            for (auto& child : grp->getChildren()) walk(*child);
+    };
+    double full = measureSeconds([&] { for (auto& obj : objects) walk(*obj); });
+    cout << "Повний обхід " << nodes << " вузлів: " << full * 1000 << " мс\n";
+    const char* queries[] = {
+        "select circles where radius >= 8 within 0 0 4095 4095",
+        "select groups where circles >= 3 and rectangles = 0",
+        "select shapes where area > 100 and (x < 1000 or y < 1000)",
+        "select rectangles where width > 11 and height > 11",
+    };
+    unsigned cores = max(1u, thread::hardware_concurrency());
+    for (const char* text : queries) {
+        auto query = SceneQuery::compile(text);
+        vector<SceneQuery::Match> one, many;
+        double t1 = measureSeconds([&] { one = query.run(objects, 1); });
+        double tn = measureSeconds([&] { many = query.run(objects, cores); });
+        bool same = one.size() == many.size();
+        for (size_t i = 0; same && i < one.size(); ++i) same = one[i].obj == many[i].obj;
+        cout << text << "\n  знайдено " << one.size() << ": 1 потік " << t1 * 1000 << " мс, " << cores << " потоків "
+             << tn * 1000 << " мс" << (same ? "" : " (РОЗБІЖНІСТЬ!)") << "\n";
+    }
+}
+
+// Просторові індекси на сценах різної будови: плиткова карта, рівномірна
+// випадкова сцена й скупчення. Для кожної — вибір за профілем, час побудови й
+// запитів (точка, вікно) у порівнянні з лінійним переглядом меж
+void benchmarkSpatialIndex() {
+    mt19937 rng(17);
+    vector<pair<string, vector<Ref<GraphicObject>>>> scenes;
+    {
+        vector<Ref<GraphicObject>> tiles;
+        for (int j = 0; j < 600; ++j)
+            for (int i = 0; i < 600; ++i) tiles.push_back(makeRef<Rectangle>(i * 8, j * 8, 7, 7));
+        scenes.push_back({"Плиткова карта 600x600", std::move(tiles)});
+    }
+    scenes.push_back({"Рівномірна сцена", generateScene(300000, 32768, 11)});
+    {
+        vector<Ref<GraphicObject>> clusters;
+        normal_distribution<double> spread(0, 300);
+        for (int c = 0; c < 300; ++c) {
+            int cx = (int)(rng() % (1 << 20)), cy = (int)(rng() % (1 << 20));
+            for (int i = 0; i < 1000; ++i)
+                clusters.push_back(makeRef<Circle>(cx + (int)spread(rng), cy + (int)spread(rng), 1 + (int)(rng() % 8)));
+        }
+        scenes.push_back({"Скупчення (300 по 1000)", std::move(clusters)});
+    }
+
+    const char* kindNames[] = {"", "сітка", "квадродерево", "BVH"};
+    for (auto& scene : scenes) {
+        vector<BBox> boxes;
+        BBox extent;
+        for (auto& obj : scene.second) {
+            boxes.push_back(obj->bounds());
+            extent.expand(boxes.back());
+        }
+        auto profile = SpatialProfile::of(boxes);
+        cout << scene.first << ": " << boxes.size() << " об'єктів, заповненість " << profile.occupancy
+             << ", великих " << profile.largeShare * 100 << "%, автовибір — " << kindNames[(int)profile.choose()] << "\n";
+
+        // Половина точок — центри об'єктів, половина — випадкові; вікна — близько 16 середніх сторін
+        vector<pair<int, int>> points(20000);
+        for (size_t i = 0; i < points.size(); ++i) {
+            if (i % 2) {
+                const BBox& b = boxes[rng() % boxes.size()];
+                points[i] = {b.minX + b.width() / 2, b.minY + b.height() / 2};
+            } else {
+                points[i] = {extent.minX + (int)(rng() % (unsigned)extent.width()),
+                             extent.minY + (int)(rng() % (unsigned)extent.height())};
+            }
+        }
+        int side = max(1, (int)(16 * profile.meanSide));
+        vector<BBox> windows(2000);
+        for (size_t i = 0; i < windows.size(); ++i)
+            windows[i] = BBox(points[i].first, points[i].second, points[i].first + side, points[i].second + side);
+
+        // Лінійний перегляд на частині запитів — заразом еталон результатів
+        const size_t checked = 100;
+        vector<vector<uint32_t>> expectedPoints(checked), expectedWindows(checked);
+        double lp = measureSeconds([&] {
+            for (size_t q = 0; q < checked; ++q)
+                for (uint32_t i = 0; i < boxes.size(); ++i)
+                    if (boxes[i].contains(points[q].first, points[q].second)) expectedPoints[q].push_back(i);
+        });
+        double lw = measureSeconds([&] {
+            for (size_t q = 0; q < checked; ++q)
+                for (uint32_t i = 0; i < boxes.size(); ++i)
+                    if (boxes[i].intersects(windows[q])) expectedWindows[q].push_back(i);
+        });
+        cout << "  лінійно: точка " << lp * 1e6 / checked << " мкс, вікно " << lw * 1e6 / checked << " мкс\n";
+
+        for (auto kind : {SpatialIndexKind::Grid, SpatialIndexKind::Quadtree, SpatialIndexKind::Bvh}) {
+            auto index = makeSpatialIndex(kind, boxes);
+            double build = measureSeconds([&] { index->build(boxes); });
+            vector<uint32_t> out;
+            bool same = true;
+            double tp = measureSeconds([&] {
+                for (size_t q = 0; q < points.size(); ++q) {
+                    index->query(points[q].first, points[q].second, out);
+                    if (q < checked) {
+                        sort(out.begin(), out.end());
+                        same = same && out == expectedPoints[q];
+                    }
+                }
+            });
+            double tw = measureSeconds([&] {
+                for (size_t q = 0; q < windows.size(); ++q) {
+                    index->query(windows[q], out);
+                    if (q < checked) {
+                        sort(out.begin(), out.end());
+                        same = same && out == expectedWindows[q];
+                    }
+                }
+            });
+            cout << "  " << index->name() << ": побудова " << build * 1000 << " мс, точка "
+                 << tp * 1e6 / points.size() << " мкс, вікно " << tw * 1e6 / windows.size() << " мкс"
+                 << (same ? "" : " (РОЗБІЖНІСТЬ!)") << "\n";
+        }
+    }
+
+    // Паралельна побудова BVH
+    vector<BBox> boxes;
+    for (auto& obj : scenes[1].second) boxes.push_back(obj->bounds());
+    unsigned cores = max(1u, thread::hardware_concurrency());
+    BoundingVolumeHierarchy one(1), many(cores);
+    double t1 = measureSeconds([&] { one.build(boxes); });
+    double tn = measureSeconds([&] { many.build(boxes); });
+    cout << "Побудова BVH (" << many.nodeCount() << " вузлів): 1 потік " << t1 * 1000 << " мс, " << cores
+         << " потоків " << tn * 1000 << " мс\n";
+}
+
+// Меню бенчмарків
+void benchmarkMenu() {
+    cout << "\n--- Бенчмарки ---\n";
+    cout << "1. Растеризація (точкова / згладжена)\n";
+    cout << "2. Рівні деталізації для віддаленого огляду\n";
+    cout << "3. Віртуальна ієрархія проти std::variant\n";
+    cout << "4. Компактне зберігання дітей групи\n";
+    cout << "5. Збереження й відкриття файлу сцени\n";
+    cout << "6. Злиття операцій реплікованої сцени (CRDT)\n";
+    cout << "7. Запити вибірки\n";
+    cout << "8. Просторові індекси: сітка, квадродерево, BVH\n";
+    cout << "0. Назад\n";
+    switch (readInt("Виберіть бенчмарк: ")) {
+        case 1: benchmarkRasterization(); break;
+        case 2: benchmarkLod(); break;
+        case 3: benchmarkVariant(); break;
+        case 4: benchmarkCompactLayout(); break;
+        case 5: benchmarkSceneFile(); break;
+        case 6: benchmarkReplication(); break;
+        case 7: benchmarkQuery(); break;
+        case 8: benchmarkSpatialIndex(); break;
+        default: break;
+    }
+}
+
+// Виконує job порціями; з терміналу раз на ~100 мс показує прогрес і перевіряє,
+// чи не натиснуто Enter для скасування. Без терміналу виконує до кінця.
+// false — скасовано або помилка (повідомлення виведено).
+bool runJob(Job& job, const string& title) {
+    bool interactive = false;
+#ifdef LB5_HAVE_POLL
+    interactive = isatty(0) != 0;
+#endif
+    auto report = [&](const char* tail) {
+        cout << "\r" << title << ": " << (int)(job.progress() * 100) << "%" << tail << flush;
+    };
+    try {
+        auto shown = chrono::steady_clock::now();
+        if (interactive) report(" (Enter — скасувати)");
+        while (job.step()) {
+            if (!interactive || chrono::steady_clock::now() - shown < chrono::milliseconds(100)) continue;
+            shown = chrono::steady_clock::now();
+            report(" (Enter — скасувати)");
+#ifdef LB5_HAVE_POLL
+            pollfd in{0, POLLIN, 0};
+            if (cin.rdbuf()->in_avail() > 0 || poll(&in, 1, 0) > 0) {
+                string line;
+                getline(cin, line);
+                job.cancel();
+                cout << "\n" << title << ": скасовано.\n";
+                return false;
+            }
+#endif
+        }
+        if (interactive) report("                    \n");
+        return job.finish();
+    } catch (const exception& e) {
+        job.cancel();
+        if (interactive) cout << "\n";
+        cout << e.what() << "\n";
+        return false;
+    }
+}
+
 // Головне меню
-void menu(EditorFacade& editor) {
+// nested — меню локальної копії сцени, вихід з якого повертає до попередньої
+void menu(EditorFacade& editor, bool nested = false) {
+    int watcher = 0; // підписка на зміни сцени (0 — немає)
+    unique_ptr<EditorFacade> peer; // локальна копія для спільного редагування
     while (true) {
+        editor.enforceMemoryBudget();
+        bool saving = editor.pollBackgroundSave();
         cout << "\n--- Меню редактора ---\n";
+        if (saving) cout << "[Фонове збереження: " << editor.backgroundSaveProgress() << "%]\n";
         cout << "1. Додати коло\n";
         cout << "2. Додати прямокутник\n";
         cout << "3. Додати групу об'єктів\n";
@@ -248,7 +5296,46 @@ void menu(EditorFacade& editor) {
         cout << "5. Undo\n";
         cout << "6. Redo\n";
         cout << "7. Знайти об'єкт за координатами\n";
-        cout << "0. Вихід\n";
+        cout << "8. Перемістити об'єкт\n";
+        cout << "9. ID-буфер для пошуку (" << (editor.isPickMode() ? "увімк." : "вимк.") << ")\n";
+        cout << "10. Показати растр (ASCII)\n";
+        cout << "11. Експорт у PGM зі згладжуванням\n";
+        cout << "12. Бенчмарки\n";
+        cout << "13. Огляд сцени зі зменшеною деталізацією\n";
+        cout << "14. Область перегляду";
+        if (!editor.getViewport().empty()) {
+            const BBox& v = editor.getViewport();
+            cout << " (" << v.minX << ", " << v.minY << ") - (" << v.maxX << ", " << v.maxY << ")";
+        }
+        cout << "\n";
+        cout << "15. Заморозити (стиснути) групи верхнього рівня\n";
+        cout << "16. Підкачка груп на диск";
+        if (editor.getPager().getBudget())
+            cout << " (бюджет " << editor.getPager().getBudget() / 1024 << " КБ, у пам'яті "
+                 << editor.getPager().residentTotal() / 1024 << " КБ, витіснень " << editor.getPager().evictionCount()
+                 << ", підвантажень " << editor.getPager().faultCount()
+                 << ", не витіснено через зовнішні посилання " << editor.getPager().pinnedCount() << ")";
+        cout << "\n";
+        cout << "17. Зберегти сцену у файл\n";
+        cout << "18. Відкрити сцену з файлу\n";
+        cout << "19. Зберегти сцену у фоні\n";
+        cout << "20. Порівняти сцену з файлом\n";
+        cout << "21. Записати дельту змін у файл\n";
+        cout << "22. Застосувати дельту з файлу\n";
+        cout << "23. Стежити за змінами сцени" << (watcher ? " (увімкнено)" : "") << "\n";
+        cout << "24. Статистика сцени та групи в точці\n";
+        cout << "25. Вибрати об'єкти запитом\n";
+        cout << "26. Дублювати сцену зі зсувом\n";
+        {
+            static const char* kinds[] = {"авто", "сітка", "квадродерево", "BVH"};
+            const char* ready = editor.hitIndexName();
+            cout << "27. Просторовий індекс (" << kinds[(int)editor.getSpatialIndexKind()] << "; "
+                 << (ready ? string("побудовано: ") + ready : string("пошук переглядає список")) << ")\n";
+        }
+        cout << "28. Редагувати локальну копію сцени (спільне редагування)";
+        if (editor.replicaId()) cout << " (копія #" << editor.replicaId() << ")";
+        cout << "\n";
+        cout << (nested ? "0. Повернутися до попередньої копії\n" : "0. Вихід\n");
         cout << "Виберіть опцію: ";
         int choice;
         cin >> choice;
@@ -295,8 +5382,288 @@ void menu(EditorFacade& editor) {
                 }
                 break;
             }
+            case 8: {
+                int x = readInt("Введіть X координату об'єкта: ");
+                int y = readInt("Введіть Y координату об'єкта: ");
+                int dx = readInt("Зсув по X: ");
+                int dy = readInt("Зсув по Y: ");
+                if (editor.moveElementAt(x, y, dx, dy))
+                    cout << "Об'єкт переміщено.\n";
+                else
+                    cout << "Об'єктів на цій позиції не знайдено.\n";
+                break;
+            }
+            case 9:
+                editor.setPickMode(!editor.isPickMode());
+                cout << "ID-буфер " << (editor.isPickMode() ? "увімкнено" : "вимкнено") << ".\n";
+                break;
+            case 10: {
+                auto fb = editor.render();
+                printRaster(cout, fb);
+                cout << "Перерастеризовано плиток: " << editor.lastRenderedTiles() << "\n";
+                break;
+            }
+            case 11: {
+                cout << "Ім'я файлу: ";
+                string path;
+                getline(cin, path);
+                int percent;
+                while ((percent = readInt("Масштаб у відсотках (1..10000): ")) <= 0 || percent > 10000)
+                    cout << "Масштаб має бути від 1 до 10000.\n";
+                int ss;
+                while ((ss = readInt("Рівень суперсемплінгу (1, 2, 4): ")) != 1 && ss != 2 && ss != 4)
+                    cout << "Рівень має бути 1, 2 або 4.\n";
+                auto job = editor.exportJob(path, percent / 100.0, ss);
+                if (job && runJob(*job, "Експорт")) {
+                    const Framebuffer& fb = static_cast<ExportJob&>(*job).result();
+                    cout << "Збережено " << fb.extent.width() << "x" << fb.extent.height() << " у " << path << ".\n";
+                }
+                break;
+            }
+            case 12:
+                benchmarkMenu();
+                break;
+            case 13: {
+                int level;
+                while ((level = readInt("Рівень (0.." + to_string(LodRenderer::maxLevel) + "): ")) < 0 || level > LodRenderer::maxLevel)
+                    cout << "Рівень поза діапазоном.\n";
+                printRaster(cout, editor.renderLod(level));
+                cout << "Перерастеризовано плиток: " << editor.lastRenderedLodTiles() << "\n";
+                break;
+            }
+            case 14: {
+                if (readInt("1 — задати область, 0 — переглядати всю сцену: ") == 0) {
+                    editor.clearViewport();
+                    cout << "Область перегляду скинуто.\n";
+                    break;
+                }
+                int x0 = readInt("X лівого верхнього кута: ");
+                int y0 = readInt("Y лівого верхнього кута: ");
+                int x1 = readInt("X правого нижнього кута: ");
+                int y1 = readInt("Y правого нижнього кута: ");
+                editor.setViewport(BBox(min(x0, x1), min(y0, y1), max(x0, x1), max(y0, y1)));
+                cout << "Область перегляду встановлено.\n";
+                break;
+            }
+            case 15: {
+                size_t skipped, before, after;
+                size_t count = editor.freezeGroups(skipped, before, after);
+                cout << "Заморожено груп: " << count << " (" << before << " -> " << after << " байт)";
+                if (skipped) cout << ", пропущено через зовнішні посилання: " << skipped;
+                cout << ".\n";
+                break;
+            }
+            case 16: {
+                int kb;
+                while ((kb = readInt("Бюджет пам'яті для груп у КБ (0 — вимкнути): ")) < 0)
+                    cout << "Бюджет не може бути від'ємним.\n";
+                editor.setPagingBudget((size_t)kb * 1024);
+                cout << "Файл підкачки: " << editor.getPager().swapSize() << " байт";
+                if (editor.getPager().pinnedCount())
+                    cout << ", не витіснено через зовнішні посилання: " << editor.getPager().pinnedCount() << " груп";
+                cout << ".\n";
+                break;
+            }
+            case 17: {
+                cout << "Ім'я файлу: ";
+                string path;
+                getline(cin, path);
+                auto job = editor.saveSceneJob(path);
+                if (job && runJob(*job, "Збереження"))
+                    cout << "Сцену збережено у " << path << " (записано " << editor.lastSaveStats().written << " байт"
+                         << (editor.lastSaveStats().full ? ", файл переписано цілком" : "") << ").\n";
+                break;
+            }
+            case 18: {
+                cout << "Ім'я файлу: ";
+                string path;
+                getline(cin, path);
+                bool lazy = readInt("1 — ліниве завантаження, 0 — повне: ") != 0;
+                if (editor.loadScene(path, lazy))
+                    cout << "Сцену завантажено, історію дій очищено.\n";
+                break;
+            }
+            case 19: {
+                cout << "Ім'я файлу: ";
+                string path;
+                getline(cin, path);
+                if (editor.saveSceneInBackground(path))
+                    cout << "Збереження у " << path << " запущено, можна продовжувати редагування.\n";
+                break;
+            }
+            case 20: {
+                cout << "Ім'я файлу: ";
+                string path;
+                getline(cin, path);
+                vector<SceneChange> changes;
+                size_t visited;
+                if (!editor.diffWithFile(path, changes, visited)) break;
+                if (changes.empty()) {
+                    cout << "Сцена не відрізняється від файлу.\n";
+                    break;
+                }
+                // Перший рядок draw — сам об'єкт без дітей
+                auto describe = [](const Ref<GraphicObject>& obj) {
+                    ostringstream os;
+                    obj->draw(os);
+                    return os.str().substr(0, os.str().find('\n'));
+                };
+                const size_t shown = 20;
+                for (size_t i = 0; i < changes.size() && i < shown; ++i) {
+                    const SceneChange& c = changes[i];
+                    string where;
+                    for (size_t k : c.path) where += (where.empty() ? "" : "/") + to_string(k);
+                    if (c.kind == SceneChange::Added) cout << "+ " << where << ": " << describe(c.after) << "\n";
+                    else if (c.kind == SceneChange::Removed) cout << "- " << where << ": " << describe(c.before) << "\n";
+                    else cout << "~ " << where << ": " << describe(c.before) << " -> " << describe(c.after) << "\n";
+                }
+                if (changes.size() > shown) cout << "... ще " << changes.size() - shown << "\n";
+                cout << "Відмінностей: " << changes.size() << ", перевірено вузлів: " << visited << ".\n";
+                break;
+            }
+            case 21: {
+                int mode;
+                while ((mode = readInt("1 — зміни з попередньої дельти, 2 — відносно файлу сцени: ")) != 1 && mode != 2)
+                    cout << "Невірний вибір.\n";
+                vector<uint8_t> bytes;
+                if (mode == 1) {
+                    bytes = editor.takeDelta();
+                } else {
+                    cout << "Файл сцени: ";
+                    string scene;
+                    getline(cin, scene);
+                    if (!editor.deltaFromFile(scene, bytes)) break;
+                }
+                cout << "Ім'я файлу дельти: ";
+                string path;
+                getline(cin, path);
+                ofstream out(path, ios::binary);
+                if (out.write((const char*)bytes.data(), (streamsize)bytes.size()))
+                    cout << "Дельту (" << bytes.size() << " байт) записано у " << path << ".\n";
+                else
+                    cout << "Не вдалося записати файл.\n";
+                break;
+            }
+            case 22: {
+                cout << "Ім'я файлу дельти: ";
+                string path;
+                getline(cin, path);
+                ifstream in(path, ios::binary);
+                if (!in) {
+                    cout << "Не вдалося відкрити файл " << path << "\n";
+                    break;
+                }
+                vector<uint8_t> bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+                bool verify = readInt("Звірити версію сцени (1 — так, 0 — ні): ") != 0;
+                size_t applied;
+                if (editor.applyDelta(bytes, applied, verify))
+                    cout << "Застосовано операцій: " << applied << ", історію дій очищено.\n";
+                break;
+            }
+            case 23: {
+                auto& events = editor.getEvents();
+                if (watcher) {
+                    events.unsubscribe(watcher);
+                    watcher = 0;
+                    cout << "Стеження вимкнено (подій опубліковано: " << events.publishedCount()
+                         << ", доставлено підписникам: " << events.deliveredCount() << ").\n";
+                    break;
+                }
+                int filter = readInt("Події (1 — усі, 2 — додавання й видалення, 3 — переміщення): ");
+                unsigned kinds = filter == 2 ? SceneEvent::Added | SceneEvent::Removed | SceneEvent::Replaced
+                               : filter == 3 ? SceneEvent::Moved : SceneEvent::All;
+                BBox region;
+                if (!editor.getViewport().empty() && readInt("Лише в області перегляду (1 — так, 0 — ні): ") == 1)
+                    region = editor.getViewport();
+                watcher = events.subscribe(kinds, [](const vector<SceneEvent>& batch, const BBox& dirty) {
+                    static const char* names[] = {"", "додано", "видалено", "", "переміщено", "", "", "", "замінено"};
+                    cout << "[Зміни сцени]";
+                    for (auto& e : batch) {
+                        if (e.kind == SceneEvent::Reset) cout << " сцену замінено;";
+                        else cout << " #" << e.id << " " << names[e.kind] << ";";
+                    }
+                    if (!dirty.empty())
+                        cout << " область (" << dirty.minX << ", " << dirty.minY << ") - ("
+                             << dirty.maxX << ", " << dirty.maxY << ")";
+                    cout << "\n";
+                }, region);
+                cout << "Стеження увімкнено.\n";
+                break;
+            }
+            case 24: {
+                auto report = [](const SubtreeStats& s) {
+                    cout << "кіл " << s.of(ShapeKind::Circle) << ", прямокутників " << s.of(ShapeKind::Rectangle)
+                         << ", груп " << s.of(ShapeKind::Group) << ", площа " << llround(s.area()) << "\n";
+                };
+                cout << "Сцена: ";
+                report(editor.sceneStats());
+                int x = readInt("X точки: ");
+                int y = readInt("Y точки: ");
+                SubtreeStats stats;
+                BBox b;
+                if (!editor.groupStatsAt(x, y, stats, b)) {
+                    cout << "У точці немає групи.\n";
+                    break;
+                }
+                cout << "Група в точці (" << b.minX << ", " << b.minY << ") - (" << b.maxX << ", " << b.maxY << "): ";
+                report(stats);
+                break;
+            }
+            case 25: {
+                cout << "Запит, наприклад: select circles where radius > 10 in 5 within 0 0 100 100\n";
+                cout << "Поля: x, y, id, radius, width, height, area; для груп count, circles, rectangles, groups\n> ";
+                string query;
+                getline(cin, query);
+                vector<SceneQuery::Match> matches;
+                auto job = editor.selectJob(query, matches);
+                if (!job) break;
+                bool ok = false;
+                double seconds = measureSeconds([&] { ok = runJob(*job, "Вибірка"); });
+                if (!ok) break;
+                cout << "Знайдено " << matches.size() << " об'єктів за " << seconds * 1000 << " мс.\n";
+                const size_t shown = 20;
+                for (size_t i = 0; i < min(shown, matches.size()); ++i) {
+                    const BBox& b = matches[i].bounds;
+                    cout << "#" << matches[i].obj->getId() << " [" << b.minX << ", " << b.minY << " - "
+                         << b.maxX << ", " << b.maxY << "] ";
+                    matches[i].obj->draw(cout);
+                }
+                if (matches.size() > shown) cout << "... і ще " << matches.size() - shown << "\n";
+                break;
+            }
+            case 26: {
+                int dx = readInt("Зсув по X: ");
+                int dy = readInt("Зсув по Y: ");
+                auto job = editor.cloneSceneJob(dx, dy);
+                if (runJob(*job, "Копіювання"))
+                    cout << "Копію сцени додано однією групою (Undo її прибирає).\n";
+                break;
+            }
+            case 27: {
+                int kind;
+                while ((kind = readInt("0 — за профілем сцени, 1 — сітка, 2 — квадродерево, 3 — BVH: ")) < 0 || kind > 3)
+                    cout << "Невірний вибір.\n";
+                editor.setSpatialIndexKind((SpatialIndexKind)kind);
+                cout << "Індекс буде побудовано у фоні для сцен від " << EditorFacade::hitIndexThreshold
+                     << " об'єктів верхнього рівня.\n";
+                break;
+            }
+            case 28: {
+                if (!peer) {
+                    peer.reset(new EditorFacade);
+                    peer->joinReplication(editor);
+                } else {
+                    peer->syncWith(editor);
+                }
+                cout << "Редагується копія #" << peer->replicaId() << "; зміни обох копій зливаються при поверненні.\n";
+                menu(*peer, true);
+                size_t here = editor.syncWith(*peer), there = peer->syncWith(editor);
+                cout << "Повернення до копії #" << editor.replicaId() << ": злито операцій " << here
+                     << " сюди й " << there << " в іншу копію" << (here ? ", історію дій очищено" : "") << ".\n";
+                break;
+            }
             case 0:
-                cout << "Вихід з програми...\n";
+                cout << (nested ? "Повернення...\n" : "Вихід з програми...\n");
                 return;
             default:
                 cout << "Невірний вибір, спробуйте ще раз.\n";
@@ -308,20 +5675,7 @@ int main() {
     EditorFacade editor;
 
     // Початкові об'єкти (за бажанням можна видалити)
-    auto c1 = make_shared<Circle>(10, 10, 5);
-    auto r1 = make_shared<Rectangle>(5, 7, 5, 6);
-
-    auto group1 = make_shared<Group>(2, 2);
-    group1->add(make_shared<Rectangle>(3, 4, 2, 3));
-    group1->add(make_shared<Circle>(1, 5, 2));
-
-    auto group2 = make_shared<Group>(4, 6);
-    group2->add(make_shared<Circle>(0, 1, 3));
-    group1->add(group2);
-
-    editor.addObject(c1);
-    editor.addObject(group1);
-    editor.addObject(r1);
+    editor.addTemplate(startScene);
 
     cout << "Початкова структура:\n";
     editor.print();